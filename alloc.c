@@ -1,6 +1,15 @@
+#define _GNU_SOURCE // mremap
 #include "alloc.h"
+#include "trace.h"
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef DEBUG
@@ -12,30 +21,541 @@
 #endif
 
 /**
- * preamble & 0xfffe: size of allocation (must be multiple of 2)
+ * preamble & 0xfff0: size of allocation (must be multiple of ALIGNMENT)
+ * preamble & 0x0008: free chunk is wide, its size is kept in the chunk
+ * preamble & 0x0004: free chunk is zero (but for its links and footer)
+ * preamble & 0x0002: previous chunk is free
  * preamble & 0x0001: is allocated to user
+ *
+ * A size of 0 marks a chunk that lives in its own mmap'd region (see
+ * `alloc_mapped()`); heap chunks are never smaller than MIN_CHUNK.
+ *
+ * Chunks start HEADER_SIZE bytes before an ALIGNMENT boundary and are a
+ * multiple of ALIGNMENT long, so every user pointer is ALIGNMENT aligned.
+ *
+ * Boundary tags: a free chunk repeats its preamble in its last bytes (the
+ * footer) and sets PREAMB_PREV_FREE in the chunk after it, so freem() can
+ * find both neighbours in constant time. Allocated chunks have no footer. A
+ * sentinel preamble (allocated, size 0) follows the last chunk of an arena so
+ * that every chunk has a next one.
+ *
+ * Wide chunks: allocated chunks are never larger than PREAMB_SIZE_MASK (larger
+ * requests are mapped), but free chunks merge into runs as long as the heap.
+ * A free chunk larger than that sets PREAMB_WIDE and all the size bits in its
+ * preamble and footer, and keeps its size in a size_t right after its links
+ * and another right before its footer (see `set_size()`). Those live in the
+ * free memory itself, so no chunk has a larger header.
+ *
+ * Memory fresh from the system is zero. Free chunks made of it keep
+ * PREAMB_ZEROED until they are merged with a chunk that was used, so that
+ * callocm() does not clear them again. The size words of a wide chunk are
+ * cleared before its memory goes to another chunk that is zero.
  */
-#define PREAMB_SIZE_MASK  0xfffe
+#define PREAMB_SIZE_MASK  (0xffff & ~(_ALIGNMENT - 1))
+#define PREAMB_WIDE       0x0008
+#define PREAMB_ZEROED     0x0004
+#define PREAMB_PREV_FREE  0x0002
 #define PREAMB_ALLOC_MASK 0x0001
 typedef uint16_t preamble_t;
-_Static_assert(_MAX_ALLOC >= sizeof(preamble_t),
-               "MAX_ALLOC cannot fit a preamble");
+_Static_assert((_ALIGNMENT & (_ALIGNMENT - 1)) == 0,
+               "ALIGNMENT must be a power of 2");
+_Static_assert(_MAX_ALLOC % _ALIGNMENT == 0,
+               "MAX_ALLOC must be a multiple of ALIGNMENT");
+_Static_assert(PREAMB_SIZE_MASK < 1 << ALLOCM_STATS_CLASSES,
+               "ALLOCM_STATS_CLASSES does not cover every chunk size");
+
+// log2 of the address space of an arena, which bounds its free chunks
+#define SPAN_LOG 30
+
+/**
+ * Out-of-band metadata: when built with OOB_METADATA, preambles are not kept
+ * in front of the user memory. Every arena has a side table (`meta`) with one
+ * preamble per ALIGNMENT bytes of its range instead; a chunk's preamble is the
+ * entry of its first ALIGNMENT bytes and its footer the entry of its last.
+ * Chunks then start on an ALIGNMENT boundary and carry no header, so a 16B
+ * request takes 16B instead of 32B, and looking at a chunk's size or state
+ * reads the dense table rather than the chunk's cache lines. Mapped chunks
+ * keep their inline header, they are the pointers that are in no arena.
+ *
+ * HEADER_SIZE is the distance from the start of a chunk to the user pointer.
+ */
+#ifdef OOB_METADATA
+#define HEADER_SIZE ((size_t)0)
+#else
+#define HEADER_SIZE sizeof(preamble_t)
+#endif
+
+/**
+ * Free chunks are kept in doubly linked lists, one per size class. The links
+ * are stored in the free chunk itself, right after the preamble (if inline),
+ * as byte offsets from the start of the heap:
+ *
+ *   | preamble | next (link_t) | prev (link_t) | ...
+ *
+ * so every chunk must be at least MIN_CHUNK bytes to be able to hold them.
+ */
+typedef uint32_t link_t;
+#define NULL_LINK ((link_t)-1)
+#define MIN_CHUNK _ALIGNMENT
+_Static_assert(MIN_CHUNK >= 2 * HEADER_SIZE + 2 * sizeof(link_t),
+               "ALIGNMENT cannot fit a free chunk");
+
+#ifndef TLSF
+/**
+ * Size classes: one exact-size class for every chunk size from MIN_CHUNK
+ * up to MAX_ALLOC, then one class per power of two above that: class
+ * NUM_EXACT + k holds chunks of (MAX_ALLOC << k, MAX_ALLOC << (k + 1)] bytes.
+ * An arena's `free_map` has bit `i` set when class `i` has at least one free
+ * chunk, so the first usable class is found with a single
+ * count-trailing-zeros.
+ */
+#define NUM_EXACT   ((_MAX_ALLOC - MIN_CHUNK) / _ALIGNMENT + 1)
+#define NUM_CLASSES (NUM_EXACT + SPAN_LOG - __builtin_ctz(_MAX_ALLOC))
+_Static_assert((_MAX_ALLOC & (_MAX_ALLOC - 1)) == 0,
+               "MAX_ALLOC must be a power of 2");
+_Static_assert(NUM_CLASSES <= 64, "Size class bitmap must fit in 64 bits");
+#else
+/**
+ * Size classes with TLSF (two-level segregated fit, make tlsf): every power
+ * of two range of chunk sizes, the first level, is split into SL_COUNT
+ * classes of equal width, the second level. Sizes below SMALL_CHUNK are all
+ * in the first level 0, one exact class per ALIGNMENT. Class
+ * fl * SL_COUNT + sl holds chunks of
+ *
+ *   [2^f + sl * 2^f / SL_COUNT, 2^f + (sl + 1) * 2^f / SL_COUNT)
+ *
+ * bytes where f = fl + log2(SMALL_CHUNK) - 1, so a chunk is never more than
+ * 1/SL_COUNT larger than the smallest size of its class. An arena's
+ * `free_map` has bit `fl` set when `sl_map[fl]` has any bit set, and that
+ * has bit `sl` set when the class has at least one free chunk: the first
+ * usable class is found with two count-trailing-zeros.
+ */
+#define SL_LOG      4
+#define SL_COUNT    (1 << SL_LOG)
+#define SMALL_CHUNK (SL_COUNT * _ALIGNMENT)
+#define FL_COUNT    (SPAN_LOG - __builtin_ctz(SMALL_CHUNK) + 1)
+#define NUM_EXACT   SL_COUNT
+#define NUM_CLASSES (FL_COUNT * SL_COUNT)
+_Static_assert(SL_COUNT <= 32, "Second level bitmap must fit in 32 bits");
+_Static_assert(SMALL_CHUNK <= PREAMB_SIZE_MASK,
+               "ALIGNMENT is too large for TLSF");
+#endif
+
+// chunks of a power of two class checked for a fit before growing the heap
+#define MAX_FIT_SCAN 16
+
+// largest free chunk allocm_batch() asks for at once
+#define MAX_RUN ((PREAMB_SIZE_MASK + _ALIGNMENT) / 2)
+
+/**
+ * Requests larger than this get their own mapping instead of a heap chunk.
+ * Mapped chunks are prefixed by MAPPED_HEADER bytes:
+ *
+ *   | length (size_t) | offset (uint32_t) | flags (uint16_t) | preamble | user
+ *
+ * where `length` is that of the mapping, `offset` is the distance from its
+ * start to the user pointer (more than MAPPED_HEADER when a larger alignment
+ * was requested) and the preamble has a size of 0. The largest threshold is
+ * bounded by what a preamble can describe.
+ */
+#define MAPPED_HEADER  0x10
+#define MAPPED_SAMPLED 0x0001 // a sample_t comes right before the header
+#define MAX_THRESHOLD (PREAMB_SIZE_MASK - HEADER_SIZE)
+_Static_assert(_MMAP_THRESHOLD <= MAX_THRESHOLD,
+               "MMAP_THRESHOLD cannot fit in a preamble");
+
+#ifdef BUDDY
+/**
+ * Buddy mode (make buddy): requests for a power of two from BUDDY_MIN to
+ * BUDDY_MAX bytes, aligned to at most that, get a block of exactly that size
+ * from a binary buddy system instead of a heap chunk or a mapping. Blocks
+ * have no header and are aligned to their size, in a range reserved like the
+ * arenas' but aligned to BUDDY_MAX. It is carved into BUDDY_MAX blocks as needed, each split in
+ * halves down to the order asked for.
+ *
+ * Every arena has a buddy system of its own, in a BUDDY_SPAN part of a range
+ * reserved for all of them, under the arena's lock. Its free blocks are kept
+ * in doubly linked lists, one per order, threaded through the blocks;
+ * `buddy_map` has bit `i` set when order BUDDY_MIN_ORDER + i has a free
+ * block. The order of every block, whether it is free and whether it is zero
+ * but for its links, is kept in a byte of `buddy_orders_g` for each BUDDY_MIN
+ * bytes of the range. A freed block is merged with its buddy, found by
+ * flipping the bit of its order in its offset, for as long as that one is
+ * free and of the same order.
+ *
+ * Free blocks of BUDDY_MAX bytes count as dirty for "Purging", which trims
+ * those at the end of the carved part off it and gives back the pages of the
+ * others, flagging them BUDDY_ZEROED. Fresh blocks are zero too, so callocm()
+ * only clears blocks that were handed out before. Smaller powers of two stay
+ * with the thread caches, which need no lock (see TCACHE_MAX_CHUNK).
+ */
+#define BUDDY_MIN_ORDER 10
+#define BUDDY_MAX_ORDER 20
+#define BUDDY_MIN       (1ULL << BUDDY_MIN_ORDER)
+#define BUDDY_MAX       (1ULL << BUDDY_MAX_ORDER)
+#define BUDDY_ORDERS    (BUDDY_MAX_ORDER - BUDDY_MIN_ORDER + 1)
+#define BUDDY_SPAN      ARENA_SPAN
+#define BUDDY_FREE      0x80 // in `buddy_orders_g`, the block is free
+#define BUDDY_ZEROED    0x40 // and zero but for its links
+_Static_assert(BUDDY_MIN >= _ALIGNMENT && BUDDY_MIN >= 2 * sizeof(void*),
+               "BUDDY_MIN cannot fit a free block");
+_Static_assert(BUDDY_MAX_ORDER < BUDDY_ZEROED, "Order cannot fit in a byte");
+
+typedef struct buddy
+{
+    struct buddy* next;
+    struct buddy* prev;
+} buddy_t;
+#endif
+
+/**
+ * Heap profile: with ALLOCM_SAMPLE_RATE set, allocm() samples about one
+ * allocation per that many bytes. Every thread counts down the bytes left to
+ * its next sample, drawn from an exponential distribution so that every byte
+ * is equally likely to be sampled. A sampled allocation gets its own mapping
+ * and its stack is kept in a sample_t in front of the mapped header, linked
+ * into the set of live samples until it is freed.
+ */
+#define SAMPLE_DEPTH   32
+#define SAMPLE_RECHECK 0x100000 // bytes between looks at a rate of 0
+
+typedef struct sample
+{
+    struct sample* next;
+    struct sample* prev;
+    size_t size;
+    size_t depth;
+    void* stack[SAMPLE_DEPTH];
+} sample_t;
+
+/**
+ * Regions: region_alloc() hands out the bytes of a block one after the other
+ * and never frees them on their own. Blocks of REGION_BLOCK bytes are heap
+ * chunks obtained through allocm(), so the heaps grow for them as usual, and
+ * requests of more than REGION_LARGE bytes get a block of their own, on a
+ * separate list. region_reset() frees only those: it rewinds to the first
+ * block and carves the others again as they are reached, so it costs the
+ * same however much the region handed out.
+ */
+#define REGION_BLOCK  0x8000
+#define REGION_LARGE  (REGION_BLOCK / 4)
+#define REGION_HEADER                                                          \
+    ((sizeof(region_block_t) + _ALIGNMENT - 1) & ~(size_t)(_ALIGNMENT - 1))
+_Static_assert(REGION_BLOCK - HEADER_SIZE <= _MMAP_THRESHOLD,
+               "REGION_BLOCK cannot be a heap chunk");
+
+typedef struct region_block
+{
+    struct region_block* next;
+    size_t size; // bytes after the header
+} region_block_t;
+
+struct region
+{
+    region_block_t* blocks;  // blocks of REGION_BLOCK bytes, in order
+    region_block_t* current; // block being carved
+    uint8_t* next;           // next free byte of `current`
+    uint8_t* limit;          // end of `current`
+    region_block_t* large;   // blocks of single large requests
+};
+
+/**
+ * Pools: objects of one size, kept on a free list linked through their first
+ * word, so pool_alloc() and pool_free() are a pop and a push. A pool gets
+ * blocks of about POOL_BLOCK bytes through allocm_aligned() when the list is
+ * empty, and carves all of a block into objects at once. Objects are only
+ * given back to the heap with the whole pool.
+ */
+#define POOL_BLOCK 0x8000
+
+typedef struct pool_block
+{
+    struct pool_block* next;
+} pool_block_t;
+
+struct pool
+{
+    void* free;           // free objects, linked through their first word
+    pool_block_t* blocks; // blocks obtained so far
+    size_t size;          // object size, a multiple of `alignment`
+    size_t alignment;
+    size_t first; // offset of a block's first object
+    size_t count; // objects per block
+};
+
+/**
+ * Arenas: independent heaps, each with its own lock, range and free lists.
+ * Every arena gets ARENA_SPAN bytes of address space, reserved (PROT_NONE) in
+ * a single mapping when the arenas are set up, and grows by making the next
+ * part of its range accessible. A chunk's arena is therefore found from its
+ * address alone. The program break is left alone: anything else in the
+ * process (glibc's malloc, stdio) may move it without getting in the way of a
+ * heap. Threads are assigned to arenas round-robin on their first call.
+ *
+ * A thread freeing a chunk of another arena does not take that arena's lock:
+ * it pushes the chunk on the arena's `remote_frees` stack (linked through the
+ * user memory) with a compare-and-swap. The arena's own threads take the
+ * whole stack with one atomic exchange and free its chunks the next time they
+ * lock the arena to allocate. A thread that exits drains the stack of its
+ * arena too, and once an arena has no thread left, chunks pushed on it are
+ * freed by whoever pushed them, so that none wait for an allocation that
+ * never comes.
+ *
+ * Arena ranges are limited to what a link_t offset can address. With
+ * OOB_METADATA, every arena's table has META_ENTRIES preambles (the last one
+ * for the sentinel).
+ */
+#define MAX_ARENAS   64
+#define ARENA_SPAN   (1ULL << SPAN_LOG)
+#define META_ENTRIES (ARENA_SPAN / _ALIGNMENT + 1)
+_Static_assert(ARENA_SPAN - 1 <= (link_t)-1, "ARENA_SPAN cannot be linked");
+
+/**
+ * Growth: a heap gets memory from the system (making more of its range
+ * accessible) ahead of what it carves into chunks, BLOCK_SIZE bytes at a
+ * time. Each time it asks for about as much as it already has, at least
+ * ALLOCM_GROW_MIN and at most ALLOCM_GROW_MAX bytes, so reaching n bytes takes
+ * O(log n) system calls. The memory not carved yet is never written, the
+ * system only backs its pages once they are used.
+ */
+#define GROW_MIN 0x10000
+#define GROW_MAX 0x4000000
+
+#ifdef SLAB
+/**
+ * Slabs (make slab): requests of MAX_ALLOC bytes or less get a slot in a slab
+ * instead of a heap chunk. A slab is a SLAB_SIZE aligned heap chunk of
+ * SLAB_SIZE bytes carved into equal slots (a multiple of ALIGNMENT each).
+ * Slots have no preamble: the slab's header, which takes up its first slots,
+ * has a bitmap with a bit set for every free slot, so a slot is found with one
+ * count-trailing-zeros and given back by setting its bit.
+ *
+ * Every arena keeps a list of the slabs of each slot size that still have
+ * free slots, and `slab_map`, a bit for every SLAB_SIZE bytes of its range set
+ * when they are a slab, which is how freem() tells a slot from a chunk. A slab
+ * whose slots are all free goes back to the heap unless it is the last one of
+ * its size.
+ *
+ * Without slabs such requests get the smallest heap chunks, which the thread
+ * caches serve as well; the check for a slot on every free is what slabs
+ * cost on mixed sizes.
+ */
+#define SLAB_SIZE      0x1000
+#define SLAB_CLASSES   (_MAX_ALLOC / _ALIGNMENT)
+#define SLAB_WORDS     ((SLAB_SIZE / _ALIGNMENT + 63) / 64)
+#define SLAB_MAP_WORDS ((ARENA_SPAN / SLAB_SIZE + 1 + 63) / 64)
+_Static_assert((SLAB_SIZE & (SLAB_SIZE - 1)) == 0,
+               "SLAB_SIZE must be a power of 2");
+_Static_assert(SLAB_SIZE >= 4 * _MAX_ALLOC, "SLAB_SIZE is too small");
+
+typedef struct slab
+{
+    struct slab* next; // slabs of the same slot size with free slots
+    struct slab* prev;
+    uint32_t slot_size;
+    uint32_t free; // number of free slots
+    uint64_t free_bits[SLAB_WORDS];
+} slab_t;
+#else
+typedef struct slab slab_t; // never defined, there are no slots
+#endif
+
+/**
+ * Purging: free memory goes back to the system gradually. Every arena counts
+ * the bytes of its free chunks whose pages the system may have had to back
+ * (`dirty`: chunks of PURGE_MIN_CHUNK bytes or more without PREAMB_ZEROED).
+ * Memory that became dirty may stay so for a while, less of it the longer
+ * ago it was freed: the arena keeps the bytes dirtied in each of the last
+ * DECAY_EPOCHS epochs of ALLOCM_DECAY_MS / DECAY_EPOCHS, and lets each keep
+ * a share that falls along a smootherstep curve, from all of it to none once
+ * ALLOCM_DECAY_MS have passed. The arena looks at the clock every DECAY_TICKS
+ * calls that take its lock (frees to its heap, refills of the threads' caches,
+ * other allocations), and a thread looks at its arena's every
+ * TCACHE_DECAY_OPS calls served by its cache alone. At the end of an epoch
+ * the arena purges what is dirty beyond that; with ALLOCM_DECAY_MS at 0 it
+ * purges all of it each time.
+ *
+ * Purging first trims the free chunks at the top of the heap off it (their
+ * part of the range is reserved again), then gives back the whole pages inside
+ * the largest other free chunks with madvise(MADV_DONTNEED). That leaves them
+ * zero, so purged chunks are flagged PREAMB_ZEROED and callocm() need not
+ * clear them.
+ */
+#define PURGE_MIN_CHUNK  0x2000
+#define DECAY_EPOCHS     16
+#define DECAY_TICKS      64
+#define TCACHE_DECAY_OPS 0x1000
+#define DECAY_MS         10000
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    uint8_t* start;     // first chunk (NULL if the arena has no range)
+    uint8_t* end;       // end of the last chunk
+    uint8_t* committed; // end of the memory obtained from the system
+    uint8_t* limit;     // end of the reserved range
+    size_t size;        // bytes carved into chunks (and the sentinel)
+    void* free_lists[NUM_CLASSES];
+    uint64_t free_map;
+#ifdef TLSF
+    uint32_t sl_map[FL_COUNT];
+#endif
+#ifdef SLAB
+    slab_t* slabs[SLAB_CLASSES];
+    uint64_t slab_map[SLAB_MAP_WORDS]; // read by any thread
+#endif
+    size_t free_bytes[ALLOCM_STATS_CLASSES]; // see `stats_free()`
+    size_t grows;                            // times the heap grew
+    size_t dirty;                            // see `dirty_bytes()`
+    size_t decay_dirty;                      // `dirty` when the epoch began
+    size_t decay_backlog[DECAY_EPOCHS];      // bytes dirtied, newest first
+    uint64_t decay_epoch;                    // start of the epoch (ms) or 0
+    uint32_t decay_ticks;                    // calls since the clock was read
+#ifdef OOB_METADATA
+    preamble_t* meta; // preamble of every ALIGNMENT bytes from `start` on
+#endif
+#ifdef BUDDY
+    uint8_t* buddy_end; // end of the part of its buddy range carved into blocks
+    buddy_t* buddy_lists[BUDDY_ORDERS]; // see "Buddy mode"
+    uint32_t buddy_map;
+#endif
+    void* remote_frees __attribute__((aligned(64))); // written by any thread
+    size_t threads; // threads assigned to it that have not exited
+} __attribute__((aligned(64))) arena_t;
+
+/**
+ * Thread caches: every thread keeps up to TCACHE_COUNT free chunks of each
+ * size up to TCACHE_MAX_CHUNK in singly linked lists threaded through the
+ * user memory. Cached chunks belong to the thread's arena and stay marked as
+ * allocated in it, so nothing else touches them. With slabs, the bins of
+ * sizes up to MAX_ALLOC hold slab slots. The arena's lock is only
+ * taken when a list runs empty (it is refilled with up to TCACHE_BATCH chunks,
+ * TCACHE_FILL_BYTES at most) or overflows (TCACHE_BATCH chunks are given
+ * back).
+ */
+#define TCACHE_MAX_CHUNK  0x400
+#define TCACHE_BINS       (TCACHE_MAX_CHUNK / _ALIGNMENT)
+#define TCACHE_COUNT      64
+#define TCACHE_BATCH      32
+#define TCACHE_FILL_BYTES 0x1000
+_Static_assert(TCACHE_BATCH <= TCACHE_COUNT, "TCACHE_BATCH is too large");
+
+// bytes of trace records buffered before they are written out
+#define TRACE_BUF_SIZE 0x10000
+
+typedef enum
+{
+    TCACHE_UNUSED, // destructor not registered yet
+    TCACHE_ACTIVE,
+    TCACHE_DEAD, // thread is exiting, bypass the cache
+} tcache_state_t;
+
+// calls counted per thread for allocm_stats()
+typedef enum
+{
+    STAT_ALLOCS,
+    STAT_FREES,
+    STAT_REALLOCS,
+    STAT_OPS,
+} stat_op_t;
+
+typedef struct tcache
+{
+    void* entries[TCACHE_BINS];
+    uint16_t counts[TCACHE_BINS];
+    tcache_state_t state;
+    arena_t* arena; // arena of the thread (NULL until its first allocation)
+    size_t ops[STAT_OPS];
+    struct tcache* next_thread; // caches of the running threads
+    struct tcache* prev_thread;
+    int64_t sample_left; // bytes to allocate before the next sample
+    uint64_t sample_seed;
+    bool sampling; // taking a sample, do not sample what that allocates
+    uint32_t decay_ops; // calls served since the arena's clock was read
+} tcache_t;
 
 /* Helper Function Prototypes */
 bool is_allocated(preamble_t);
 size_t get_size(preamble_t);
-void* get_free_chunk(size_t);
+void* get_free_chunk(arena_t*, size_t);
 void print_heap();
-void combine_chunks(void*);
+void* combine_chunks(arena_t*, void*);
+static size_t size_class(size_t);
+static void list_insert(arena_t*, void*);
+static void list_remove(arena_t*, void*);
+static void* alloc_mapped(size_t, size_t, bool);
+static void free_mapped(void*);
+static void* realloc_mapped(void*, size_t);
+static inline bool is_sampled(const uint8_t*);
+static void sample_link(sample_t*);
+static void sample_unlink(sample_t*);
+static void* heap_alloc(arena_t*, size_t, size_t, bool*);
+static size_t heap_alloc_batch(arena_t*, size_t, void**, size_t);
+static void heap_free(arena_t*, void*);
+static bool heap_resize(arena_t*, void*, size_t);
+#ifdef SLAB
+static slab_t* slab_of(arena_t*, void*);
+static void* slab_alloc(arena_t*, size_t);
+static size_t slab_alloc_batch(arena_t*, size_t, void**, size_t);
+static void slab_free(arena_t*, slab_t*, void*);
+#endif
+static void arena_free(arena_t*, void*);
+#ifdef BUDDY
+static void buddy_purge(arena_t*, size_t);
+#endif
+static arena_t* thread_arena(tcache_t*);
+static arena_t* arena_of(void*);
+static void remote_free(arena_t*, void*);
+static void drain_remote_frees(arena_t*);
+static void* tcache_get(tcache_t*, size_t);
+static void tcache_put(tcache_t*, void*, size_t);
+static void tcache_flush(tcache_t*, size_t, size_t);
+static void trace_record(uint8_t, const void*, size_t, size_t, const void*);
+static void trace_append(uint8_t, const void*, size_t, size_t, const void*);
+static inline void stats_free(arena_t*, size_t, size_t);
 
 /* Global Variables */
-void* heap_start_g = NULL;
-void* heap_end_g = NULL;
-size_t heap_size_g = 0;
+size_t heap_size_g = 0;   // bytes carved into chunks across arenas
+size_t mapped_size_g = 0; // bytes in mapped chunks
+static arena_t arenas_g[MAX_ARENAS];
+static size_t num_arenas_g = 0; // 0 until the arenas are set up
+static uint8_t* arena_base_g = NULL; // reserved range of all arenas
+#ifdef OOB_METADATA
+static preamble_t* meta_base_g = NULL; // tables of all arenas
+#endif
+static size_t next_arena_g = 0;
+static pthread_once_t arenas_once_g = PTHREAD_ONCE_INIT;
+static size_t arenas_opt_g = 0; // ALLOCM_ARENAS, 0 for one per CPU
+static size_t mmap_threshold_g = _MMAP_THRESHOLD;
+static size_t decay_ms_g = DECAY_MS; // ALLOCM_DECAY_MS
+static size_t grow_min_g = GROW_MIN; // ALLOCM_GROW_MIN
+static size_t grow_max_g = GROW_MAX; // ALLOCM_GROW_MAX
+static __thread tcache_t tcache_g;
+static pthread_key_t tcache_key_g;
+static pthread_once_t tcache_once_g = PTHREAD_ONCE_INIT;
+static tcache_t* threads_g = NULL; // registered caches, see tcache_register()
+static pthread_mutex_t threads_lock_g = PTHREAD_MUTEX_INITIALIZER;
+static size_t exited_ops_g[STAT_OPS]; // calls of threads that have exited
+static size_t sample_rate_g = 0;      // ALLOCM_SAMPLE_RATE, 0 for none
+static sample_t* samples_g = NULL;    // live sampled allocations
+static pthread_mutex_t samples_lock_g = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd_g = -1; // ALLOCM_TRACE file, -1 when not tracing
+static pthread_mutex_t trace_lock_g = PTHREAD_MUTEX_INITIALIZER;
+#ifdef BUDDY
+static uint8_t* buddy_base_g = NULL;   // reserved range of all buddy systems
+static uint8_t* buddy_orders_g = NULL; // see "Buddy mode"
+#endif
+static uint8_t trace_buf_g[TRACE_BUF_SIZE];
+static size_t trace_len_g = 0;
+static uintptr_t trace_last_g = 0; // previous pointer of the trace
+static size_t fork_arenas_g = 0;   // arenas locked by fork_prepare()
 
 /* Global constants */
 static const size_t BLOCK_SIZE = _BLOCK_SIZE;
-static const size_t MAX_ALLOC = _MAX_ALLOC;
+#if !defined(TLSF) || defined(SLAB)
+static const size_t MAX_ALLOC = _MAX_ALLOC; // TLSF classes do without it
+#endif
+static const size_t ALIGNMENT = _ALIGNMENT;
 
 /**
  * @brief Check if a chunk is allocated to the user
@@ -60,225 +580,3715 @@ inline size_t get_size(preamble_t preamble)
 }
 
 /**
- * @brief Return free chunk of at least a certain size. If no chunk exists, brk
- * will be called to allocate more memory.
+ * @brief Get the size class a free chunk of `size` bytes is listed under
  *
- * @param size Size of chunk to find (including preamble)
- * @return void* Pointer to chunk of size >= `size`
+ * @param size Size of the chunk (including preamble)
+ * @return index into an arena's `free_lists`
  */
-void* get_free_chunk(size_t size)
+static inline size_t size_class(size_t size)
 {
-    // initialize the heap start
-    if (heap_start_g == NULL)
+#ifndef TLSF
+    if (size > MAX_ALLOC)
     {
-        dprintf("Initializing Heap\n");
-        heap_start_g = heap_end_g = sbrk(0);
+        // (MAX_ALLOC << k, MAX_ALLOC << (k + 1)] --> NUM_EXACT + k
+        size_t k = (63 - __builtin_clzll(size - 1)) - __builtin_ctz(MAX_ALLOC);
+        return NUM_EXACT + k;
     }
-
-    // check size parameter
-    if ((size % 2) == 1)
+    return (size - MIN_CHUNK) / ALIGNMENT;
+#else
+    if (size >= SMALL_CHUNK)
     {
-        dprintf("Chunk size (%zu) is odd... bumping to %zu\n", size, size + 1);
-        size++;
+        // the SL_LOG bits below the highest one pick the second level
+        size_t f = 63 - __builtin_clzll(size);
+        size_t fl = f - __builtin_ctz(SMALL_CHUNK) + 1;
+        return fl * SL_COUNT + (size >> (f - SL_LOG)) - SL_COUNT;
     }
-    if (size > MAX_ALLOC)
+    return size / ALIGNMENT;
+#endif
+}
+
+/**
+ * @brief Mark a size class as having free chunks
+ */
+static inline void class_set(arena_t* arena, size_t class)
+{
+#ifndef TLSF
+    arena->free_map |= 1ULL << class;
+#else
+    arena->sl_map[class / SL_COUNT] |= 1U << class % SL_COUNT;
+    arena->free_map |= 1ULL << class / SL_COUNT;
+#endif
+}
+
+/**
+ * @brief Mark a size class as having no free chunks
+ */
+static inline void class_clear(arena_t* arena, size_t class)
+{
+#ifndef TLSF
+    arena->free_map &= ~(1ULL << class);
+#else
+    size_t fl = class / SL_COUNT;
+    arena->sl_map[fl] &= ~(1U << class % SL_COUNT);
+    if (arena->sl_map[fl] == 0)
     {
-        dprintf("Chunk size (%zu) too large (size > %zu)\n", size, MAX_ALLOC);
-        return NULL;
+        arena->free_map &= ~(1ULL << fl);
     }
+#endif
+}
 
-    // traverse through currently allocated memory to find free block
-    dprintf("Searching for free chunk of memory\n");
-    void* curr_chunk = heap_start_g;
-    while (curr_chunk < heap_end_g)
+/**
+ * @brief Find the first size class with free chunks from `first` on
+ *
+ * @return the class, NUM_CLASSES if there is none
+ */
+static inline size_t class_find(arena_t* arena, size_t first)
+{
+#ifndef TLSF
+    uint64_t candidates =
+        first < 64 ? arena->free_map & (~0ULL << first) : 0;
+    return candidates != 0 ? (size_t)__builtin_ctzll(candidates) : NUM_CLASSES;
+#else
+    if (first >= NUM_CLASSES)
     {
-        preamble_t* preamble = curr_chunk;
-        preamble_t curr_chunk_size = get_size(*preamble);
-
-        // valid chunk
-        if (!is_allocated(*preamble))
+        return NUM_CLASSES;
+    }
+    size_t fl = first / SL_COUNT;
+    uint32_t sl = arena->sl_map[fl] & (~0U << first % SL_COUNT);
+    if (sl == 0)
+    {
+        uint64_t fls = arena->free_map & (~0ULL << (fl + 1));
+        if (fls == 0)
         {
-            // combine chunks to get larger chunk
-            combine_chunks(curr_chunk);
-            curr_chunk_size = get_size(*preamble);
-
-            if (curr_chunk_size >= size)
-            {
-                dprintf("Free chunk found: %p\n", curr_chunk);
-                return curr_chunk;
-            }
+            return NUM_CLASSES;
         }
-
-        // go to next chunk
-        curr_chunk = (uint8_t*)curr_chunk + curr_chunk_size;
+        fl = __builtin_ctzll(fls);
+        sl = arena->sl_map[fl];
     }
+    return fl * SL_COUNT + __builtin_ctz(sl);
+#endif
+}
 
-    // no memory is free --> allocate more memory
-    dprintf("No free chunk found... allocating more memory\n");
-
-    // save end of heap to be start of next block
-    uint8_t* block = heap_end_g;
+/**
+ * @brief Get the preamble of a heap chunk, inline or in its arena's table
+ *
+ * @param arena Arena the chunk belongs to
+ * @param chunk Start of the chunk (or the end of the heap for the sentinel)
+ * @return preamble_t* Where the chunk's preamble is stored
+ */
+static inline preamble_t* get_preamble(arena_t* arena, void* chunk)
+{
+#ifdef OOB_METADATA
+    return &arena->meta[((uint8_t*)chunk - arena->start) / ALIGNMENT];
+#else
+    (void)arena;
+    return chunk;
+#endif
+}
 
-    sbrk(BLOCK_SIZE); // syscall to allocate more memory
-    heap_end_g = (uint8_t*)heap_end_g + BLOCK_SIZE;
-    heap_size_g += BLOCK_SIZE;
+// the footer of a free chunk is the preamble slot right before the next one
+#define get_footer(arena, next_chunk) (get_preamble(arena, next_chunk) - 1)
 
-    // fill blocks' preamble
-    size_t i;
-    for (i = 0; i + MAX_ALLOC <= BLOCK_SIZE; i += MAX_ALLOC)
-    {
-        // set chunk to size MAX_ALLOC
-        *(preamble_t*)(block + i) = MAX_ALLOC & PREAMB_SIZE_MASK;
-    }
-    // set remaining chunk size
-    if (i < BLOCK_SIZE)
-    {
-        *(preamble_t*)(block + i) = (BLOCK_SIZE - i) & PREAMB_SIZE_MASK;
-    }
+// size words of a wide chunk: right after its links, and right before its
+// footer (aligned down)
+#define wide_head(chunk)                                                       \
+    ((size_t*)((uint8_t*)(chunk) + HEADER_SIZE + 2 * sizeof(link_t)))
+#define wide_foot(next_chunk)                                                  \
+    ((size_t*)(((uintptr_t)(next_chunk) - HEADER_SIZE - sizeof(size_t)) &     \
+               ~(sizeof(size_t) - 1)))
 
-    return block;
+/**
+ * @brief Get the size of a heap chunk, wide or not
+ *
+ * @param arena Arena the chunk belongs to
+ * @param chunk Start of the chunk
+ * @return size of the chunk
+ */
+static inline size_t get_chunk_size(arena_t* arena, void* chunk)
+{
+    preamble_t preamble = *get_preamble(arena, chunk);
+    return preamble & PREAMB_WIDE ? *wide_head(chunk) : get_size(preamble);
 }
 
-void* allocm(size_t size)
+/**
+ * @brief Get the size of the free chunk before a chunk, from its footer
+ *
+ * @param arena Arena the chunks belong to
+ * @param chunk Chunk whose preamble has PREAMB_PREV_FREE
+ * @return size of the chunk before
+ */
+static inline size_t get_prev_size(arena_t* arena, void* chunk)
 {
-    dprintf("size = %zu\n", size);
+    preamble_t footer = *get_footer(arena, chunk);
+    return footer & PREAMB_WIDE ? *wide_foot(chunk) : get_size(footer);
+}
 
-    // size must be divisible by 2 to be used in preamble
-    if ((size % 2) == 1)
+/**
+ * @brief Write the preamble of a chunk, and its head size word if it is wide
+ *
+ * @param arena Arena the chunk belongs to
+ * @param chunk Chunk to write
+ * @param size Size of the chunk
+ * @param flags Flags of the preamble
+ * @return the preamble written, also good for the footer
+ */
+static inline preamble_t set_size(arena_t* arena, void* chunk, size_t size,
+                                  preamble_t flags)
+{
+    preamble_t preamble = size | flags;
+    if (size > PREAMB_SIZE_MASK)
     {
-        dprintf("Size (%zu) is odd... bumping to %zu\n", size, size + 1);
-        size++;
+        preamble = PREAMB_SIZE_MASK | PREAMB_WIDE | flags;
+        *wide_head(chunk) = size;
     }
+    *get_preamble(arena, chunk) = preamble;
+    return preamble;
+}
 
-    /* Look for free chunk */
-    size_t chunk_size = size + sizeof(preamble_t);
-    void* chunk = get_free_chunk(chunk_size);
-    preamble_t rem;
-    if (chunk == NULL)
+/**
+ * @brief Clear the size words of a wide chunk whose memory is about to be
+ * split up or merged into another chunk
+ *
+ * @param arena Arena the chunk belongs to
+ * @param chunk Start of the chunk
+ * @param size Size of the chunk
+ */
+static inline void clear_wide(arena_t* arena, void* chunk, size_t size)
+{
+    (void)arena;
+    if (size > PREAMB_SIZE_MASK)
     {
-        dprintf("Memory could not be allocated\n");
-        return NULL;
+        *wide_head(chunk) = 0;
+        *wide_foot((uint8_t*)chunk + size) = 0;
     }
+}
 
-    // remaining free chunk space
-    rem = *(preamble_t*)chunk - chunk_size;
+/**
+ * @brief Mark a chunk free: write its preamble and footer and flag it in the
+ * preamble of the next chunk
+ *
+ * @param arena Arena the chunk belongs to
+ * @param chunk Chunk to mark
+ * @param size Size of the chunk
+ * @param flags PREAMB_PREV_FREE if the chunk before it is free, and
+ * PREAMB_ZEROED if the chunk is zero
+ */
+static inline void set_free(arena_t* arena, void* chunk, size_t size,
+                            preamble_t flags)
+{
+    uint8_t* next_chunk = (uint8_t*)chunk + size;
 
-    /* Allocate in free chunk */
-    if (rem > 0)
+    *get_footer(arena, next_chunk) = set_size(arena, chunk, size, flags);
+    if (size > PREAMB_SIZE_MASK)
     {
-        uint8_t* next_chunk = (uint8_t*)chunk + chunk_size;
-        *(preamble_t*)next_chunk = rem;
+        *wide_foot(next_chunk) = size;
     }
+    *get_preamble(arena, next_chunk) |= PREAMB_PREV_FREE;
+}
 
-    /* Add preamble and set to 'allocated' */
-    *(preamble_t*)chunk = chunk_size | PREAMB_ALLOC_MASK;
+/**
+ * @brief Mark a chunk allocated and clear its flag in the next chunk
+ *
+ * @param arena Arena the chunk belongs to
+ * @param chunk Chunk to mark
+ * @param size Size of the chunk
+ * @param prev_free PREAMB_PREV_FREE if the chunk before it is free, else 0
+ */
+static inline void set_allocated(arena_t* arena, void* chunk, size_t size,
+                                 preamble_t prev_free)
+{
+    *get_preamble(arena, chunk) = size | prev_free | PREAMB_ALLOC_MASK;
+    *get_preamble(arena, (uint8_t*)chunk + size) &= ~PREAMB_PREV_FREE;
+}
 
-#ifdef CLEAN_MEMORY
-    dprintf("Filling user's memory\n");
-    for (size_t i = 0; i < size; i++)
-    {
-        *((uint8_t*)chunk + sizeof(preamble_t) + i) = 0xAA;
-    }
-#endif
+/**
+ * @brief Round `size` up to the next multiple of `align` (a power of 2)
+ */
+static inline size_t align_up(size_t size, size_t align)
+{
+    return (size + align - 1) & ~(align - 1);
+}
 
-    dprintf("Allocating %zu Bytes at %p\n", size, chunk + sizeof(preamble_t));
-    // offset pointer from preamble
-    return chunk + sizeof(preamble_t);
+static inline link_t* get_links(void* chunk)
+{
+    return (link_t*)((uint8_t*)chunk + HEADER_SIZE);
 }
 
-void freem(void* ptr)
+// links are offsets from the start of the chunk's arena
+static inline void* get_link(arena_t* arena, void* chunk, size_t which)
 {
-    dprintf("ptr = %p\n", ptr);
+    link_t link = get_links(chunk)[which];
+    return link == NULL_LINK ? NULL : arena->start + link;
+}
 
-    if (ptr == NULL)
-    {
-        dprintf("Trying to free a NULL pointer\n");
-        return;
-    }
+static inline void set_link(arena_t* arena, void* chunk, size_t which,
+                            void* target)
+{
+    get_links(chunk)[which] =
+        target == NULL ? NULL_LINK
+                       : (link_t)((uint8_t*)target - arena->start);
+}
 
-    // chunk starts sizeof(preamble_t) bytes before user's ptr
-    uint8_t* chunk = (uint8_t*)ptr - sizeof(preamble_t);
-    preamble_t* preamble = (preamble_t*)chunk;
-    if (!is_allocated(*preamble))
-    {
-        // memory not allocated
-        dprintf("Memory at %p is already unallocated (Preamble: %#6X)\n", ptr,
-                *preamble);
-        return;
-    }
-    // set "free" bit to 0
-    *preamble = *preamble & PREAMB_SIZE_MASK;
+#define get_next(arena, chunk)       get_link(arena, chunk, 0)
+#define get_prev(arena, chunk)       get_link(arena, chunk, 1)
+#define set_next(arena, chunk, next) set_link(arena, chunk, 0, next)
+#define set_prev(arena, chunk, prev) set_link(arena, chunk, 1, prev)
 
-    // combine free chunks together
-    combine_chunks(chunk);
+/**
+ * @brief Add to a counter that only one thread writes (the arena's lock holder
+ * or the cache's owner) and allocm_stats() reads at any time
+ *
+ * @param counter Counter to add to
+ * @param n Number to add (may wrap around to subtract)
+ */
+static inline void stats_add(size_t* counter, size_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
 }
 
-void combine_chunks(void* start)
+/**
+ * @brief Count free bytes of an arena for allocm_stats(), which reads them
+ * without taking the lock. The caller must hold the arena's lock.
+ *
+ * @param arena Arena the memory belongs to
+ * @param size Size of the chunk or slot, which decides the class counted in
+ * @param bytes Number of bytes that became free (or, negative, were taken)
+ */
+static inline void stats_free(arena_t* arena, size_t size, size_t bytes)
 {
-    // cannot combine a chunk that already is allocated
-    if (start == NULL || is_allocated(*(preamble_t*)start))
+    // wide chunks all go in the last class
+    size_t class = 63 - __builtin_clzll(size);
+    if (class >= ALLOCM_STATS_CLASSES)
     {
-        dprintf("Start is allocated!");
-        return;
+        class = ALLOCM_STATS_CLASSES - 1;
     }
+    stats_add(&arena->free_bytes[class], bytes);
+}
 
-    uint8_t* chunk = start;
-    preamble_t* preamble = start;
-    preamble_t size = get_size(*preamble);
-    uint8_t* heap_end = heap_end_g;
-    uint8_t* next_chunk = chunk + size;
-    while (next_chunk < heap_end)
-    {
-        // if next chunk is used, cannot combine anymore
-        // if the current chunk is too big, don't need to combine anymore
-        if (is_allocated(*(preamble_t*)next_chunk) || size >= MAX_ALLOC)
-        {
-            break;
-        }
-
-        // combine chunk with adjacent chunk
-        dprintf("Combining %p (%dB) with %p (%dB)\n", chunk, size, next_chunk,
-                *(preamble_t*)next_chunk);
-        *preamble = (size + *(preamble_t*)next_chunk);
-        size = get_size(*preamble);
-        next_chunk = chunk + size;
-    }
+/**
+ * @brief Get the bytes a free chunk adds to its arena's `dirty` count: all of
+ * them if it is large enough to be purged and not zero already
+ *
+ * @param preamble Preamble of the free chunk
+ * @param size Size of the free chunk
+ * @return number of dirty bytes
+ */
+static inline size_t dirty_bytes(preamble_t preamble, size_t size)
+{
+    return size >= PURGE_MIN_CHUNK && !(preamble & PREAMB_ZEROED) ? size : 0;
 }
 
-void print_heap()
+/**
+ * @brief Add a free chunk to the front of its size class list
+ *
+ * @param arena Arena the chunk belongs to
+ * @param chunk Free chunk (preamble must already hold its size)
+ */
+static void list_insert(arena_t* arena, void* chunk)
 {
-    dprintf("\n");
-    int rows = heap_size_g / 0x10;
-    int cols = 0x10;
+    preamble_t preamble = *get_preamble(arena, chunk);
+    size_t size = get_chunk_size(arena, chunk);
+    size_t class = size_class(size);
+    void* head = arena->free_lists[class];
 
-    uint8_t* curr_addr = heap_start_g;
+    stats_free(arena, size, size);
+    arena->dirty += dirty_bytes(preamble, size);
 
-    printf("\t  pointer   \t_0____1____2____3____4____5____6____7____8____9___"
-           "10___11___12___13___14___15\n");
-    // 16 bytes per row
-    for (int i = 0; i < rows; i++)
+    set_next(arena, chunk, head);
+    set_prev(arena, chunk, NULL);
+    if (head != NULL)
     {
-        printf("\t%p:\t", curr_addr);
-        // print each byte
-        for (int j = 0; j < cols; j++)
-        {
-            printf("%02X   ", *curr_addr++);
-        }
-        printf("\n");
+        set_prev(arena, head, chunk);
     }
-    printf("\n");
+    arena->free_lists[class] = chunk;
+    class_set(arena, class);
+}
 
-    printf("\t  pointer    size(B)    hex  used \n");
-    // print by chunk
-    curr_addr = heap_start_g;
-    while (curr_addr < (uint8_t*)heap_end_g)
-    {
-        preamble_t preamble = *(preamble_t*)curr_addr;
-        size_t size = get_size(preamble);
+/**
+ * @brief Unlink a free chunk from its size class list
+ *
+ * @param arena Arena the chunk belongs to
+ * @param chunk Free chunk currently in the list matching its size
+ */
+static void list_remove(arena_t* arena, void* chunk)
+{
+    preamble_t preamble = *get_preamble(arena, chunk);
+    size_t size = get_chunk_size(arena, chunk);
+    size_t class = size_class(size);
+    void* next = get_next(arena, chunk);
+    void* prev = get_prev(arena, chunk);
 
-        printf("\t%p  %5zu  (%#6zx)   %c\n", curr_addr, size, size,
-               is_allocated(preamble) ? 'X' : ' ');
+    stats_free(arena, size, -size);
+    arena->dirty -= dirty_bytes(preamble, size);
 
-        curr_addr += size;
+    if (prev != NULL)
+    {
+        set_next(arena, prev, next);
+    }
+    else
+    {
+        arena->free_lists[class] = next;
+    }
+    if (next != NULL)
+    {
+        set_prev(arena, next, prev);
+    }
+
+    if (arena->free_lists[class] == NULL)
+    {
+        class_clear(arena, class);
+    }
+}
+
+/**
+ * @brief Set up the arenas: decide how many there are and reserve their
+ * address space
+ */
+static void arenas_init(void)
+{
+    size_t count = arenas_opt_g;
+    if (count == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        count = cpus < 1 ? 1 : cpus > MAX_ARENAS ? MAX_ARENAS : cpus;
+    }
+
+    // with no room for them all, a single arena; with none at all, every
+    // block is mapped on its own
+    arena_base_g = mmap(NULL, count * ARENA_SPAN, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena_base_g == MAP_FAILED && count > 1)
+    {
+        dprintf("Could not reserve %zu arenas\n", count);
+        count = 1;
+        arena_base_g = mmap(NULL, ARENA_SPAN, PROT_NONE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1,
+                            0);
+    }
+    if (arena_base_g == MAP_FAILED)
+    {
+        dprintf("Could not reserve an arena\n");
+        arena_base_g = NULL;
+    }
+
+#ifdef OOB_METADATA
+    // pages of the tables are only backed once they are written to
+    meta_base_g = mmap(NULL, count * META_ENTRIES * sizeof(preamble_t),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (meta_base_g == MAP_FAILED)
+    {
+        dprintf("Could not reserve the metadata tables\n");
+        meta_base_g = NULL;
+    }
+#endif
+
+#ifdef BUDDY
+    // without them, powers of two are served like other sizes
+    uint8_t* orders = mmap(NULL, count * (BUDDY_SPAN / BUDDY_MIN),
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    // mmap only aligns to a page, blocks are aligned to their size by
+    // aligning the range to BUDDY_MAX and giving back the rest
+    size_t length = count * BUDDY_SPAN + BUDDY_MAX;
+    uint8_t* region = mmap(NULL, length, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (orders == MAP_FAILED || region == MAP_FAILED)
+    {
+        dprintf("Could not reserve the buddy systems\n");
+        if (orders != MAP_FAILED)
+        {
+            munmap(orders, count * (BUDDY_SPAN / BUDDY_MIN));
+        }
+        if (region != MAP_FAILED)
+        {
+            munmap(region, length);
+        }
+    }
+    else
+    {
+        uint8_t* buddy_base =
+            (uint8_t*)align_up((uintptr_t)region, BUDDY_MAX);
+        uint8_t* end = buddy_base + count * BUDDY_SPAN;
+        if (buddy_base > region)
+        {
+            munmap(region, buddy_base - region);
+        }
+        if (end < region + length)
+        {
+            munmap(end, region + length - end);
+        }
+        buddy_orders_g = orders;
+        __atomic_store_n(&buddy_base_g, buddy_base, __ATOMIC_RELEASE);
+    }
+#endif
+
+    for (size_t i = 0; i < count; i++)
+    {
+        arena_t* arena = &arenas_g[i];
+        pthread_mutex_init(&arena->lock, NULL);
+        if (arena_base_g != NULL)
+        {
+            uint8_t* range = arena_base_g + i * ARENA_SPAN;
+            // user memory of the first chunk starts on an ALIGNMENT boundary
+            arena->start = arena->end =
+                range + (ALIGNMENT - HEADER_SIZE) % ALIGNMENT;
+            arena->committed = range;
+            arena->limit = range + ARENA_SPAN;
+        }
+#ifdef OOB_METADATA
+        if (meta_base_g != NULL)
+        {
+            arena->meta = meta_base_g + i * META_ENTRIES;
+        }
+#endif
+#ifdef BUDDY
+        if (buddy_base_g != NULL)
+        {
+            arena->buddy_end = buddy_base_g + i * BUDDY_SPAN;
+        }
+#endif
+    }
+
+    dprintf("%zu arenas\n", count);
+    __atomic_store_n(&num_arenas_g, count, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Get the arena of the calling thread, assigning one round-robin on
+ * its first call
+ *
+ * @param tcache Calling thread's cache
+ * @return arena_t* Arena the thread allocates from
+ */
+static inline arena_t* thread_arena(tcache_t* tcache)
+{
+    if (tcache->arena == NULL)
+    {
+        pthread_once(&arenas_once_g, arenas_init);
+        size_t next = __atomic_fetch_add(&next_arena_g, 1, __ATOMIC_RELAXED);
+        tcache->arena = &arenas_g[next % num_arenas_g];
+        __atomic_fetch_add(&tcache->arena->threads, 1, __ATOMIC_SEQ_CST);
+        dprintf("Thread uses arena %zu\n", next % num_arenas_g);
+    }
+    return tcache->arena;
+}
+
+/**
+ * @brief Find the arena a chunk belongs to
+ *
+ * @param chunk Heap chunk (or, with OOB_METADATA, any chunk)
+ * @return arena_t* Arena whose range holds `chunk`. With OOB_METADATA, NULL
+ * for a mapped chunk
+ */
+static inline arena_t* arena_of(void* chunk)
+{
+    size_t offset = (uint8_t*)chunk - arena_base_g;
+    if (arena_base_g != NULL && (uint8_t*)chunk >= arena_base_g &&
+        offset < num_arenas_g * ARENA_SPAN)
+    {
+        return &arenas_g[offset / ARENA_SPAN];
+    }
+#ifdef OOB_METADATA
+    // mapped chunks have no preamble to tell them apart, only their address
+    return NULL;
+#else
+    // a mapped chunk, its preamble says so
+    return &arenas_g[0];
+#endif
+}
+
+/**
+ * @brief Get more memory from the system for an arena (see "Growth")
+ *
+ * @param arena Arena to grow
+ * @param end Address up to which the memory is needed
+ * @return true on success, false if the system has no more for the arena
+ */
+static bool arena_obtain(arena_t* arena, uint8_t* end)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (arena->limit == NULL)
+    {
+        dprintf("Arena has no range\n");
+        return false;
+    }
+    uint8_t* base = arena->limit - ARENA_SPAN;
+    size_t room = ARENA_SPAN - (arena->committed - base);
+    size_t need = end - arena->committed;
+    if (need > room)
+    {
+        dprintf("Arena is full\n");
+        return false;
+    }
+
+    size_t min = __atomic_load_n(&grow_min_g, __ATOMIC_RELAXED);
+    size_t max = __atomic_load_n(&grow_max_g, __ATOMIC_RELAXED);
+    size_t step = arena->committed - base;
+    step = step > max ? max : step;
+    step = step < min ? min : step;
+    step = align_up(step > need ? step : need, page);
+    step = step > room ? room : step;
+
+    // a step the system refuses may still leave enough for the request
+    for (;;)
+    {
+        if (mprotect(arena->committed, step, PROT_READ | PROT_WRITE) == 0)
+        {
+            break;
+        }
+        dprintf("mprotect(%p, %zu) failed\n", arena->committed, step);
+        if (step == align_up(need, page) || align_up(need, page) > room)
+        {
+            return false;
+        }
+        step = align_up(need, page);
+    }
+
+    arena->committed += step;
+    __atomic_store_n(&arena->grows, arena->grows + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * @brief Extend an arena's heap by `size` bytes. The memory right after the
+ * new end (where the sentinel preamble goes) is accessible too.
+ *
+ * @param arena Arena to grow
+ * @param size Number of bytes to add (multiple of ALIGNMENT)
+ * @return void* Start of the new memory, or NULL if the arena cannot grow
+ */
+static void* arena_grow(arena_t* arena, size_t size)
+{
+    uint8_t* block = arena->end;
+    // the first block also makes room for the sentinel
+    size_t extra = arena->size == 0 ? HEADER_SIZE : 0;
+
+#ifdef OOB_METADATA
+    if (arena->meta == NULL)
+    {
+        dprintf("Arena has no metadata table\n");
+        return NULL;
+    }
+#endif
+
+    uint8_t* end = block + size + sizeof(preamble_t);
+    if (end > arena->committed && !arena_obtain(arena, end))
+    {
+        return NULL;
+    }
+
+    arena->end += size;
+    arena->size += size + extra;
+    __atomic_fetch_add(&heap_size_g, size + extra, __ATOMIC_RELAXED);
+    return block;
+}
+
+/**
+ * @brief Return free chunk of at least a certain size. If no chunk exists, the
+ * arena grows to make one. The chunk is removed from its free list before
+ * being returned. The caller must hold the arena's lock.
+ *
+ * @param arena Arena to allocate from
+ * @param size Size of chunk to find (including preamble)
+ * @return void* Pointer to chunk of size >= `size`
+ */
+void* get_free_chunk(arena_t* arena, size_t size)
+{
+    // check size parameter
+    if (size % ALIGNMENT != 0)
+    {
+        dprintf("Chunk size (%zu) is unaligned... bumping to %zu\n", size,
+                align_up(size, ALIGNMENT));
+        size = align_up(size, ALIGNMENT);
+    }
+    if (size < MIN_CHUNK)
+    {
+        size = MIN_CHUNK;
+    }
+    if (size > PREAMB_SIZE_MASK)
+    {
+        dprintf("Chunk size (%zu) too large (size > %d)\n", size,
+                PREAMB_SIZE_MASK);
+        return NULL;
+    }
+
+    // first non-empty class whose chunks are all large enough for `size`.
+    // Exact classes always are; a class of a range of sizes only from the
+    // next one on
+    dprintf("Searching for free chunk of memory\n");
+    size_t class = size_class(size);
+    size_t first = class < NUM_EXACT ? class : class + 1;
+    size_t found = class_find(arena, first);
+    void* chunk = NULL;
+    if (found < NUM_CLASSES)
+    {
+        chunk = arena->free_lists[found];
+    }
+    else
+    {
+        // only chunks in `size`'s own class are left: first fit among the
+        // first few of them, growing the heap beats walking a long list
+        size_t tries = 0;
+        for (chunk = arena->free_lists[class];
+             chunk != NULL && tries < MAX_FIT_SCAN;
+             chunk = get_next(arena, chunk), tries++)
+        {
+            if (get_chunk_size(arena, chunk) >= size)
+            {
+                break;
+            }
+        }
+        if (tries == MAX_FIT_SCAN)
+        {
+            chunk = NULL;
+        }
+    }
+    if (chunk != NULL)
+    {
+        dprintf("Free chunk found: %p\n", chunk);
+        list_remove(arena, chunk);
+        return chunk;
+    }
+
+    // no memory is free --> allocate more memory
+    dprintf("No free chunk found... allocating more memory\n");
+
+    size_t block_size = align_up(size, BLOCK_SIZE);
+    if (block_size > PREAMB_SIZE_MASK)
+    {
+        block_size = size;
+    }
+
+    // the sentinel at the end of heap says if the last chunk is free
+    preamble_t last_free =
+        arena->size > 0 ? *get_preamble(arena, arena->end) & PREAMB_PREV_FREE
+                        : 0;
+
+    // end of heap becomes the start of the next block
+    uint8_t* block = arena_grow(arena, block_size);
+    if (block == NULL)
+    {
+        return NULL;
+    }
+    *get_preamble(arena, arena->end) = PREAMB_ALLOC_MASK;
+
+    // the whole block becomes one chunk, allocm() splits off what it needs.
+    // It extends the last chunk when that one is free
+    preamble_t flags = PREAMB_ZEROED;
+    if (last_free)
+    {
+        size_t last_size = get_prev_size(arena, block);
+        uint8_t* last = block - last_size;
+        list_remove(arena, last);
+        flags = *get_preamble(arena, last) & (PREAMB_PREV_FREE | PREAMB_ZEROED);
+        // the old footer and sentinel end up inside the chunk
+        clear_wide(arena, last, last_size);
+        memset(block - sizeof(preamble_t), 0, 2 * HEADER_SIZE);
+        block = last;
+        block_size += last_size;
+    }
+    set_free(arena, block, block_size, flags);
+
+    return block;
+}
+
+/**
+ * @brief Give back the whole pages of an arena's table that hold the
+ * preambles of the memory from `from` to `to` (only with OOB_METADATA)
+ */
+static void meta_purge(arena_t* arena, uint8_t* from, uint8_t* to)
+{
+#ifdef OOB_METADATA
+    size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t lo = align_up((uintptr_t)get_preamble(arena, from), page);
+    uintptr_t hi = (uintptr_t)get_preamble(arena, to) & ~(page - 1);
+    if (lo < hi)
+    {
+        madvise((void*)lo, hi - lo, MADV_DONTNEED);
+    }
+#else
+    (void)arena, (void)from, (void)to;
+#endif
+}
+
+/**
+ * @brief Give the end of an arena's heap back to the system. The memory left
+ * accessible after the new end is cleared, the heap grows back into it.
+ *
+ * @param arena Arena to shrink
+ * @param end New end of the heap (the sentinel must already be there)
+ * @return true on success, false if the heap is unchanged
+ */
+static bool arena_shrink(arena_t* arena, uint8_t* end)
+{
+    size_t size = arena->end - end;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    // the memory obtained but not carved yet goes back with it
+    uint8_t* committed =
+        (uint8_t*)align_up((uintptr_t)end + sizeof(preamble_t), page);
+    if (committed < arena->committed)
+    {
+        size_t release = arena->committed - committed;
+        // the range is reserved again, dropping its pages
+        if (mmap(committed, release, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1,
+                 0) == MAP_FAILED)
+        {
+            dprintf("mmap(%p) failed\n", committed);
+            return false;
+        }
+        arena->committed = committed;
+    }
+
+    // up to where the memory is kept, which is past the page `zero` ends
+    // when the sentinel's preamble starts it
+    uint8_t* zero = end + HEADER_SIZE;
+    uint8_t* zero_end = committed;
+    if (zero_end > arena->end + HEADER_SIZE)
+    {
+        zero_end = arena->end + HEADER_SIZE;
+    }
+    memset(zero, 0, zero_end - zero);
+    meta_purge(arena, end + ALIGNMENT, arena->end + ALIGNMENT);
+
+    arena->end = end;
+    arena->size -= size;
+    __atomic_fetch_sub(&heap_size_g, size, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * @brief Trim the free chunks at the top of an arena's heap off it, as long
+ * as the arena has more than `target` dirty bytes or they are zero anyway.
+ * The caller must hold the arena's lock.
+ *
+ * @param arena Arena to trim
+ * @param target Dirty bytes the arena may keep
+ */
+static void arena_trim(arena_t* arena, size_t target)
+{
+    if (arena->start == NULL)
+    {
+        return;
+    }
+
+    uint8_t* end = arena->end;
+    preamble_t preamble = *get_preamble(arena, end);
+    size_t dirty = arena->dirty;
+    while (end > arena->start && (preamble & PREAMB_PREV_FREE))
+    {
+        size_t size = get_prev_size(arena, end);
+        uint8_t* chunk = end - size;
+        preamble_t chunk_preamble = *get_preamble(arena, chunk);
+        if (dirty <= target && !(chunk_preamble & PREAMB_ZEROED))
+        {
+            break;
+        }
+        dirty -= dirty_bytes(chunk_preamble, size);
+        end = chunk;
+        preamble = chunk_preamble;
+    }
+    if (end == arena->end)
+    {
+        return;
+    }
+
+    // the links live in the chunks, they are unlinked while they are there
+    for (uint8_t* chunk = end; chunk < arena->end;
+         chunk += get_chunk_size(arena, chunk))
+    {
+        list_remove(arena, chunk);
+    }
+    *get_preamble(arena, end) =
+        PREAMB_ALLOC_MASK | (preamble & PREAMB_PREV_FREE);
+
+    dprintf("Trimming %zu Bytes at %p\n", (size_t)(arena->end - end), end);
+    if (!arena_shrink(arena, end))
+    {
+        *get_preamble(arena, end) = preamble;
+        for (uint8_t* chunk = end; chunk < arena->end;
+             chunk += get_chunk_size(arena, chunk))
+        {
+            list_insert(arena, chunk);
+        }
+    }
+}
+
+/**
+ * @brief Give dirty memory of an arena back to the system until it has at
+ * most `target` dirty bytes (see "Purging"). The caller must hold the arena's
+ * lock.
+ *
+ * @param arena Arena to purge
+ * @param target Dirty bytes the arena may keep
+ */
+static void arena_purge(arena_t* arena, size_t target)
+{
+    arena_trim(arena, target);
+#ifdef BUDDY
+    buddy_purge(arena, target);
+#endif
+
+    // the largest chunks first, they give back the most per system call
+    size_t page = sysconf(_SC_PAGESIZE);
+    for (size_t class = NUM_CLASSES - 1;
+         class >= size_class(PURGE_MIN_CHUNK) && arena->dirty > target;
+         class--)
+    {
+        for (uint8_t* chunk = arena->free_lists[class];
+             chunk != NULL && arena->dirty > target;
+             chunk = get_next(arena, chunk))
+        {
+            preamble_t* preamble = get_preamble(arena, chunk);
+            size_t size = get_chunk_size(arena, chunk);
+            if (dirty_bytes(*preamble, size) == 0)
+            {
+                continue;
+            }
+
+            // all but the links, the size words and the footer ends up zero
+            uint8_t* lo = chunk + HEADER_SIZE + 2 * sizeof(link_t);
+            uint8_t* hi = chunk + size - HEADER_SIZE;
+            if (*preamble & PREAMB_WIDE)
+            {
+                lo = (uint8_t*)(wide_head(chunk) + 1);
+                hi = (uint8_t*)wide_foot(chunk + size);
+            }
+            uint8_t* first = (uint8_t*)align_up((uintptr_t)lo, page);
+            uint8_t* last = (uint8_t*)((uintptr_t)hi & ~(page - 1));
+            if (first >= last ||
+                madvise(first, last - first, MADV_DONTNEED) != 0)
+            {
+                continue;
+            }
+            memset(lo, 0, first - lo);
+            memset(last, 0, hi - last);
+            if (*preamble & PREAMB_WIDE)
+            {
+                // the padding between the foot size word and the footer
+                uint8_t* tail = (uint8_t*)(wide_foot(chunk + size) + 1);
+                memset(tail, 0, chunk + size - HEADER_SIZE - tail);
+            }
+            // the footer is the table's last entry for the chunk
+            meta_purge(arena, first, last < hi ? last : hi - ALIGNMENT);
+
+            arena->dirty -= size;
+            *preamble |= PREAMB_ZEROED;
+            *get_footer(arena, chunk + size) |= PREAMB_ZEROED;
+        }
+    }
+}
+
+static inline uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Purge what an arena has dirty beyond what the decay curve allows
+ * (see "Purging"), once an epoch is over. The caller must hold the arena's
+ * lock.
+ *
+ * @param arena Arena to look at
+ */
+static void arena_decay(arena_t* arena)
+{
+    size_t decay_ms = __atomic_load_n(&decay_ms_g, __ATOMIC_RELAXED);
+    if (decay_ms == 0)
+    {
+        arena_purge(arena, 0);
+        return;
+    }
+
+    uint64_t now = now_ms();
+    uint64_t epoch_ms = decay_ms >= DECAY_EPOCHS ? decay_ms / DECAY_EPOCHS : 1;
+    if (arena->decay_epoch == 0)
+    {
+        arena->decay_epoch = now;
+        arena->decay_dirty = arena->dirty;
+        return;
+    }
+    uint64_t epochs = (now - arena->decay_epoch) / epoch_ms;
+    if (epochs == 0)
+    {
+        return;
+    }
+
+    // what became dirty since the last epoch is the newest
+    size_t* backlog = arena->decay_backlog;
+    if (epochs >= DECAY_EPOCHS)
+    {
+        memset(backlog, 0, DECAY_EPOCHS * sizeof(size_t));
+    }
+    else
+    {
+        memmove(backlog + epochs, backlog,
+                (DECAY_EPOCHS - epochs) * sizeof(size_t));
+        memset(backlog, 0, epochs * sizeof(size_t));
+    }
+    backlog[0] = arena->dirty > arena->decay_dirty
+                     ? arena->dirty - arena->decay_dirty
+                     : 0;
+
+    // each epoch keeps 1 - smootherstep(age / ALLOCM_DECAY_MS) of its bytes
+    double limit = 0;
+    for (size_t i = 0; i < DECAY_EPOCHS; i++)
+    {
+        double x = (double)(i + 1) / DECAY_EPOCHS;
+        limit += backlog[i] * (1 - x * x * x * (x * (x * 6 - 15) + 10));
+    }
+    if (arena->dirty > limit)
+    {
+        dprintf("Purging %zu of %zu dirty Bytes\n",
+                arena->dirty - (size_t)limit, arena->dirty);
+        arena_purge(arena, (size_t)limit);
+    }
+
+    arena->decay_dirty = arena->dirty;
+    arena->decay_epoch += epochs * epoch_ms;
+}
+
+/**
+ * @brief Count a call that took the arena's lock, and let the arena look at
+ * the clock every DECAY_TICKS of them. The caller must hold the arena's lock.
+ *
+ * @param arena Arena to count the call in
+ */
+static inline void arena_tick(arena_t* arena)
+{
+    if (++arena->decay_ticks == DECAY_TICKS)
+    {
+        arena->decay_ticks = 0;
+        arena_decay(arena);
+    }
+}
+
+/**
+ * @brief Give a request its own anonymous mapping, bypassing the heap. The
+ * system call dwarfs a call, so this is kept out of line.
+ *
+ * @param size Number of bytes requested by the user
+ * @param alignment Alignment of the returned pointer (power of 2)
+ * @param sampled Whether to make room for a sample_t in front of the header
+ * @return void* Pointer to user memory, or NULL if mmap failed
+ */
+__attribute__((noinline)) static void* alloc_mapped(size_t size,
+                                                   size_t alignment,
+                                                   bool sampled)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t prefix = MAPPED_HEADER + (sampled ? sizeof(sample_t) : 0);
+    size_t pad = (alignment > MAPPED_HEADER ? alignment : MAPPED_HEADER) +
+                 prefix - MAPPED_HEADER;
+    if (size > SIZE_MAX - pad - page || pad > UINT32_MAX)
+    {
+        dprintf("Size (%zu) too large to map\n", size);
+        return NULL;
+    }
+    size_t length = align_up(size + pad, page);
+
+    uint8_t* region = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+    {
+        dprintf("mmap(%zu) failed\n", length);
+        return NULL;
+    }
+
+    // the header must fit before `ptr`, give back whole pages around it
+    uint8_t* ptr = (uint8_t*)align_up((uintptr_t)region + prefix, alignment);
+    uint8_t* start = (uint8_t*)((uintptr_t)(ptr - prefix) & ~(page - 1));
+    uint8_t* end = (uint8_t*)align_up((uintptr_t)ptr + size, page);
+    if (start > region)
+    {
+        munmap(region, start - region);
+    }
+    if (end < region + length)
+    {
+        munmap(end, region + length - end);
+    }
+
+    *(size_t*)(ptr - MAPPED_HEADER) = end - start;
+    __atomic_fetch_add(&mapped_size_g, end - start, __ATOMIC_RELAXED);
+    *(uint32_t*)(ptr - MAPPED_HEADER + sizeof(size_t)) = ptr - start;
+    *(uint16_t*)(ptr - MAPPED_HEADER + sizeof(size_t) + sizeof(uint32_t)) =
+        sampled ? MAPPED_SAMPLED : 0;
+    *(preamble_t*)(ptr - sizeof(preamble_t)) = PREAMB_ALLOC_MASK;
+
+    dprintf("Mapped %zu Bytes at %p for %zu Bytes\n", (size_t)(end - start),
+            start, size);
+    return ptr;
+}
+
+/**
+ * @brief Unmap a chunk returned by `alloc_mapped()`
+ *
+ * @param ptr Pointer to user memory
+ */
+static void free_mapped(void* ptr)
+{
+    uint8_t* header = (uint8_t*)ptr - MAPPED_HEADER;
+    size_t length = *(size_t*)header;
+    uint8_t* start = (uint8_t*)ptr - *(uint32_t*)(header + sizeof(size_t));
+
+    if (is_sampled(header))
+    {
+        pthread_mutex_lock(&samples_lock_g);
+        sample_unlink((sample_t*)header - 1);
+        pthread_mutex_unlock(&samples_lock_g);
+    }
+
+    dprintf("Unmapping %zu Bytes at %p\n", length, start);
+    munmap(start, length);
+    __atomic_fetch_sub(&mapped_size_g, length, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Resize a chunk returned by `alloc_mapped()` with mremap, so that the
+ * data is never copied. The offset of the user pointer in its page is kept.
+ *
+ * @param ptr Pointer to user memory
+ * @param size New number of bytes
+ * @return void* Pointer to user memory (possibly moved), or NULL if mremap
+ * failed (`ptr` is left untouched)
+ */
+static void* realloc_mapped(void* ptr, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    uint8_t* header = (uint8_t*)ptr - MAPPED_HEADER;
+    size_t length = *(size_t*)header;
+    size_t offset = *(uint32_t*)(header + sizeof(size_t));
+    if (size > SIZE_MAX - offset - page)
+    {
+        dprintf("Size (%zu) too large to map\n", size);
+        return NULL;
+    }
+
+    size_t new_length = align_up(offset + size, page);
+    uint8_t* start = (uint8_t*)ptr - offset;
+    bool sampled = is_sampled(header);
+    if (sampled)
+    {
+        // a sample moves with its mapping, it is out of the set meanwhile
+        pthread_mutex_lock(&samples_lock_g);
+        sample_unlink((sample_t*)header - 1);
+    }
+
+    void* new_ptr = ptr;
+    if (new_length != length)
+    {
+        uint8_t* new_start = mremap(start, length, new_length, MREMAP_MAYMOVE);
+        if (new_start == MAP_FAILED)
+        {
+            dprintf("mremap(%zu) failed\n", new_length);
+            new_ptr = NULL;
+        }
+        else
+        {
+            dprintf("Remapped %zu Bytes at %p to %zu Bytes at %p\n", length,
+                    start, new_length, new_start);
+            start = new_start;
+            new_ptr = start + offset;
+            *(size_t*)(start + offset - MAPPED_HEADER) = new_length;
+            __atomic_fetch_add(&mapped_size_g, new_length - length,
+                               __ATOMIC_RELAXED);
+        }
+    }
+
+    if (sampled)
+    {
+        sample_t* sample = (sample_t*)(start + offset - MAPPED_HEADER) - 1;
+        if (new_ptr != NULL)
+        {
+            sample->size = size;
+        }
+        sample_link(sample);
+        pthread_mutex_unlock(&samples_lock_g);
+    }
+    return new_ptr;
+}
+
+#ifdef BUDDY
+/**
+ * @brief Check if memory is a block of a buddy system
+ *
+ * @param ptr Pointer to user memory
+ */
+static inline bool is_buddy(const void* ptr)
+{
+    uint8_t* base = __atomic_load_n(&buddy_base_g, __ATOMIC_ACQUIRE);
+    return base != NULL && (const uint8_t*)ptr >= base &&
+           (size_t)((const uint8_t*)ptr - base) < num_arenas_g * BUDDY_SPAN;
+}
+
+/**
+ * @brief Get the arena whose buddy system a block belongs to
+ */
+static inline arena_t* buddy_arena(const void* block)
+{
+    return &arenas_g[((const uint8_t*)block - buddy_base_g) / BUDDY_SPAN];
+}
+
+/**
+ * @brief Get the entry of a block in `buddy_orders_g`
+ */
+static inline uint8_t* buddy_entry(const void* block)
+{
+    return &buddy_orders_g[((const uint8_t*)block - buddy_base_g) /
+                           BUDDY_MIN];
+}
+
+/**
+ * @brief Get the size of a block of a buddy system
+ *
+ * @param ptr Block handed out by `buddy_alloc()`
+ * @return size_t Size of the block
+ */
+static inline size_t buddy_size(const void* ptr)
+{
+    return 1ULL << (*buddy_entry(ptr) & ~(BUDDY_FREE | BUDDY_ZEROED));
+}
+
+/**
+ * @brief Add a free block to the list of its order. The caller must hold the
+ * arena's lock.
+ *
+ * @param arena Arena whose buddy system the block belongs to
+ * @param block Free block
+ * @param order log2 of the block size
+ * @param zeroed Whether the block is zero but for its links
+ */
+static void buddy_push(arena_t* arena, void* block, size_t order, bool zeroed)
+{
+    size_t i = order - BUDDY_MIN_ORDER;
+    buddy_t* head = arena->buddy_lists[i];
+    buddy_t* buddy = block;
+    buddy->next = head;
+    buddy->prev = NULL;
+    if (head != NULL)
+    {
+        head->prev = buddy;
+    }
+    arena->buddy_lists[i] = buddy;
+    arena->buddy_map |= 1U << i;
+    *buddy_entry(block) = order | BUDDY_FREE | (zeroed ? BUDDY_ZEROED : 0);
+    if (order == BUDDY_MAX_ORDER && !zeroed)
+    {
+        arena->dirty += BUDDY_MAX;
+    }
+}
+
+/**
+ * @brief Unlink a free block from the list of its order. The caller must hold
+ * the arena's lock.
+ *
+ * @return true if the block was zero but for its links
+ */
+static bool buddy_unlink(arena_t* arena, void* block, size_t order)
+{
+    size_t i = order - BUDDY_MIN_ORDER;
+    buddy_t* buddy = block;
+    if (buddy->prev != NULL)
+    {
+        buddy->prev->next = buddy->next;
+    }
+    else
+    {
+        arena->buddy_lists[i] = buddy->next;
+    }
+    if (buddy->next != NULL)
+    {
+        buddy->next->prev = buddy->prev;
+    }
+    if (arena->buddy_lists[i] == NULL)
+    {
+        arena->buddy_map &= ~(1U << i);
+    }
+
+    bool zeroed = *buddy_entry(block) & BUDDY_ZEROED;
+    if (order == BUDDY_MAX_ORDER && !zeroed)
+    {
+        arena->dirty -= BUDDY_MAX;
+    }
+    return zeroed;
+}
+
+/**
+ * @brief Get a block from the buddy system of the calling thread's arena,
+ * splitting a larger one if no block of the order is free. Kept out of line,
+ * like `alloc_mapped()`.
+ *
+ * @param arena Arena to allocate from
+ * @param order log2 of the block size, from BUDDY_MIN_ORDER to BUDDY_MAX_ORDER
+ * @param zeroed Set to whether the block is known to be zero
+ * @return void* The block, or NULL if the arena's buddy range is used up
+ */
+__attribute__((noinline)) static void* buddy_alloc(arena_t* arena,
+                                                   size_t order, bool* zeroed)
+{
+    if (buddy_base_g == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&arena->lock);
+    uint8_t* block;
+    size_t found;
+    uint32_t candidates = arena->buddy_map & (~0U << (order - BUDDY_MIN_ORDER));
+    if (candidates != 0)
+    {
+        found = BUDDY_MIN_ORDER + __builtin_ctz(candidates);
+        block = (uint8_t*)arena->buddy_lists[found - BUDDY_MIN_ORDER];
+        *zeroed = buddy_unlink(arena, block, found);
+    }
+    else
+    {
+        // carve the next BUDDY_MAX bytes of the range, fresh from the system
+        uint8_t* range = buddy_base_g + (arena - arenas_g) * BUDDY_SPAN;
+        if (arena->buddy_end == range + BUDDY_SPAN ||
+            mprotect(arena->buddy_end, BUDDY_MAX, PROT_READ | PROT_WRITE) != 0)
+        {
+            dprintf("Buddy range is full\n");
+            pthread_mutex_unlock(&arena->lock);
+            return NULL;
+        }
+        block = arena->buddy_end;
+        arena->buddy_end += BUDDY_MAX;
+        found = BUDDY_MAX_ORDER;
+        *zeroed = true;
+        __atomic_fetch_add(&mapped_size_g, BUDDY_MAX, __ATOMIC_RELAXED);
+    }
+
+    // the upper halves go free, the lower one is split further
+    while (found > order)
+    {
+        found--;
+        buddy_push(arena, block + (1ULL << found), found, *zeroed);
+    }
+    *buddy_entry(block) = order;
+    arena_tick(arena);
+    pthread_mutex_unlock(&arena->lock);
+
+    if (*zeroed)
+    {
+        // the links of the block it was on its list with
+        memset(block, 0, sizeof(buddy_t));
+    }
+    dprintf("Buddy block of %llu Bytes at %p\n", 1ULL << order, block);
+    return block;
+}
+
+/**
+ * @brief Give a block back to its buddy system, merging it with its buddy
+ * as long as that one is free, and purge its arena now and then
+ *
+ * @param ptr Block handed out by `buddy_alloc()`
+ */
+static void buddy_free(void* ptr)
+{
+    uint8_t* block = ptr;
+    arena_t* arena = buddy_arena(block);
+    pthread_mutex_lock(&arena->lock);
+    size_t order = *buddy_entry(block);
+    if (order & BUDDY_FREE)
+    {
+        dprintf("Buddy block at %p is already free\n", ptr);
+        pthread_mutex_unlock(&arena->lock);
+        return;
+    }
+
+    // the block was used, so whatever it is merged into is not zero
+    while (order < BUDDY_MAX_ORDER)
+    {
+        uint8_t* buddy =
+            buddy_base_g + ((block - buddy_base_g) ^ (1ULL << order));
+        if ((*buddy_entry(buddy) & ~BUDDY_ZEROED) != (order | BUDDY_FREE))
+        {
+            break;
+        }
+        buddy_unlink(arena, buddy, order);
+        // the upper half is no block of its own anymore
+        *buddy_entry(buddy > block ? buddy : block) = 0;
+        block = buddy < block ? buddy : block;
+        order++;
+    }
+    buddy_push(arena, block, order, false);
+
+    // a whole BUDDY_MAX block could go back to the system right away
+    if (order == BUDDY_MAX_ORDER)
+    {
+        arena_decay(arena);
+    }
+    else
+    {
+        arena_tick(arena);
+    }
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * @brief Give the free BUDDY_MAX blocks of an arena's buddy system back to the
+ * system until it has at most `target` dirty bytes: those at the end of the
+ * carved part are trimmed off it, the pages of the others are dropped (see
+ * "Buddy mode"). The caller must hold the arena's lock.
+ *
+ * @param arena Arena to purge
+ * @param target Dirty bytes the arena may keep
+ */
+static void buddy_purge(arena_t* arena, size_t target)
+{
+    if (buddy_base_g == NULL)
+    {
+        return;
+    }
+
+    // zero blocks at the end go back too, they need not be kept
+    uint8_t* range = buddy_base_g + (arena - arenas_g) * BUDDY_SPAN;
+    while (arena->buddy_end > range)
+    {
+        uint8_t* block = arena->buddy_end - BUDDY_MAX;
+        uint8_t entry = *buddy_entry(block);
+        if ((entry & ~BUDDY_ZEROED) != (BUDDY_MAX_ORDER | BUDDY_FREE) ||
+            (arena->dirty <= target && !(entry & BUDDY_ZEROED)))
+        {
+            break;
+        }
+        bool zeroed = buddy_unlink(arena, block, BUDDY_MAX_ORDER);
+        // the range is reserved again, dropping its pages
+        if (mmap(block, BUDDY_MAX, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1,
+                 0) == MAP_FAILED)
+        {
+            dprintf("mmap(%p) failed\n", block);
+            buddy_push(arena, block, BUDDY_MAX_ORDER, zeroed);
+            break;
+        }
+        dprintf("Trimming buddy block at %p\n", block);
+        *buddy_entry(block) = 0;
+        arena->buddy_end = block;
+        __atomic_fetch_sub(&mapped_size_g, BUDDY_MAX, __ATOMIC_RELAXED);
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    for (buddy_t* buddy = arena->buddy_lists[BUDDY_ORDERS - 1];
+         buddy != NULL && arena->dirty > target; buddy = buddy->next)
+    {
+        uint8_t* entry = buddy_entry(buddy);
+        if (*entry & BUDDY_ZEROED)
+        {
+            continue;
+        }
+
+        // all but the links ends up zero
+        uint8_t* lo = (uint8_t*)(buddy + 1);
+        uint8_t* first = (uint8_t*)align_up((uintptr_t)lo, page);
+        if (madvise(first, (uint8_t*)buddy + BUDDY_MAX - first,
+                    MADV_DONTNEED) != 0)
+        {
+            continue;
+        }
+        memset(lo, 0, first - lo);
+        *entry |= BUDDY_ZEROED;
+        arena->dirty -= BUDDY_MAX;
+    }
+}
+#endif
+
+/**
+ * @brief Check if a mapped chunk carries a sample
+ *
+ * @param header Mapped header of the chunk
+ * @return if a sample_t precedes the header
+ */
+static inline bool is_sampled(const uint8_t* header)
+{
+    return *(const uint16_t*)(header + sizeof(size_t) + sizeof(uint32_t)) &
+           MAPPED_SAMPLED;
+}
+
+/**
+ * @brief Add a sample to the live set. The caller must hold the samples lock.
+ */
+static void sample_link(sample_t* sample)
+{
+    sample->prev = NULL;
+    sample->next = samples_g;
+    if (samples_g != NULL)
+    {
+        samples_g->prev = sample;
+    }
+    samples_g = sample;
+}
+
+/**
+ * @brief Remove a sample from the live set. The caller must hold the samples
+ * lock.
+ */
+static void sample_unlink(sample_t* sample)
+{
+    if (sample->prev != NULL)
+    {
+        sample->prev->next = sample->next;
+    }
+    else
+    {
+        samples_g = sample->next;
+    }
+    if (sample->next != NULL)
+    {
+        sample->next->prev = sample->prev;
+    }
+}
+
+/**
+ * @brief Draw the number of bytes until a thread's next sample from an
+ * exponential distribution with mean `rate`
+ *
+ * @param tcache Calling thread's cache, which holds its random state
+ * @param rate Mean number of bytes between samples
+ * @return number of bytes
+ */
+static int64_t sample_interval(tcache_t* tcache, size_t rate)
+{
+    // xorshift64*
+    uint64_t x = tcache->sample_seed;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    tcache->sample_seed = x;
+    uint32_t q = ((x * 0x2545f4914f6cdd1dULL) >> 38) + 1; // 1 to 2^26
+
+    // -ln(q / 2^26), with log2(q) taken as the position of its top bit plus
+    // the rest of it read as a fraction (off by 0.09 at most)
+    int top = 31 - __builtin_clz(q);
+    double log2_q = top + (double)(q - (1U << top)) / (1U << top);
+    double interval = (26 - log2_q) * 0.6931471805599453 * rate;
+    return interval < INT64_MAX / 2 ? (int64_t)interval + 1 : INT64_MAX / 2;
+}
+
+/**
+ * @brief Called when a thread's countdown runs out: start the next one and
+ * decide whether the allocation that ran it out is sampled. Kept out of line,
+ * like alloc_mapped(), so allocm_internal() stays small enough to inline.
+ *
+ * @param tcache Calling thread's cache
+ * @return if the allocation is to be sampled
+ */
+__attribute__((noinline)) static bool sample_due(tcache_t* tcache)
+{
+    size_t rate = __atomic_load_n(&sample_rate_g, __ATOMIC_RELAXED);
+    if (rate == 0)
+    {
+        tcache->sample_left = SAMPLE_RECHECK;
+        return false;
+    }
+    if (tcache->sample_seed == 0)
+    {
+        // the first countdown of a thread: nothing has been counted yet
+        tcache->sample_seed = (uintptr_t)tcache * 0x9e3779b97f4a7c15ULL | 1;
+        tcache->sample_left = sample_interval(tcache, rate);
+        return false;
+    }
+    tcache->sample_left = sample_interval(tcache, rate);
+    return !tcache->sampling;
+}
+
+/**
+ * @brief Give a sampled request its own mapping and record its stack
+ *
+ * @param tcache Calling thread's cache
+ * @param size Number of bytes requested by the user
+ * @param alignment Alignment of the returned pointer (power of 2)
+ * @return void* Pointer to user memory, or NULL if mmap failed
+ */
+__attribute__((noinline)) static void* alloc_sampled(tcache_t* tcache,
+                                                    size_t size,
+                                                    size_t alignment)
+{
+    uint8_t* ptr = alloc_mapped(size, alignment, true);
+    if (ptr == NULL)
+    {
+        return NULL;
+    }
+
+    // backtrace() may allocate the first time it runs
+    sample_t* sample = (sample_t*)(ptr - MAPPED_HEADER) - 1;
+    tcache->sampling = true;
+    int depth = backtrace(sample->stack, SAMPLE_DEPTH);
+    tcache->sampling = false;
+    sample->depth = depth > 0 ? depth : 0;
+    sample->size = size;
+
+    dprintf("Sampled %zu Bytes at %p\n", size, ptr);
+    pthread_mutex_lock(&samples_lock_g);
+    sample_link(sample);
+    pthread_mutex_unlock(&samples_lock_g);
+    return ptr;
+}
+
+int allocm_setopt(allocm_option_t option, size_t value)
+{
+    switch (option)
+    {
+    case ALLOCM_MMAP_THRESHOLD:
+        if (value > MAX_THRESHOLD)
+        {
+            dprintf("Threshold (%zu) too large (> %zu)\n", value,
+                    MAX_THRESHOLD);
+            return -1;
+        }
+        __atomic_store_n(&mmap_threshold_g, value, __ATOMIC_RELAXED);
+        return 0;
+    case ALLOCM_ARENAS:
+        if (value > MAX_ARENAS ||
+            __atomic_load_n(&num_arenas_g, __ATOMIC_ACQUIRE) != 0)
+        {
+            dprintf("Arenas (%zu) cannot be changed (max %d)\n", value,
+                    MAX_ARENAS);
+            return -1;
+        }
+        arenas_opt_g = value;
+        return 0;
+    case ALLOCM_SAMPLE_RATE:
+        __atomic_store_n(&sample_rate_g, value, __ATOMIC_RELAXED);
+        return 0;
+    case ALLOCM_DECAY_MS:
+        __atomic_store_n(&decay_ms_g, value, __ATOMIC_RELAXED);
+        return 0;
+    case ALLOCM_GROW_MIN:
+    case ALLOCM_GROW_MAX:
+        if (value == 0 || value > ARENA_SPAN)
+        {
+            dprintf("Growth (%zu) out of range (1 to %llu)\n", value,
+                    ARENA_SPAN);
+            return -1;
+        }
+        __atomic_store_n(option == ALLOCM_GROW_MIN ? &grow_min_g : &grow_max_g,
+                         value, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    dprintf("Unknown option %d\n", option);
+    return -1;
+}
+
+/**
+ * @brief Split the tail of an allocated chunk off into a free chunk, if what is
+ * left over beyond `size` bytes can hold one
+ *
+ * @param arena Arena the chunk belongs to
+ * @param chunk Chunk taken off the free lists (preamble holds its size)
+ * @param size Number of bytes to keep (multiple of ALIGNMENT)
+ * @return size of the chunk after the split
+ */
+static size_t split_chunk(arena_t* arena, void* chunk, size_t size)
+{
+    preamble_t preamble = *get_preamble(arena, chunk);
+    size_t chunk_size = get_chunk_size(arena, chunk);
+    size_t rem = chunk_size - size;
+    clear_wide(arena, chunk, chunk_size);
+
+    if (rem < MIN_CHUNK)
+    {
+        // remainder cannot hold a free chunk, hand it out with this one
+        return size + rem;
+    }
+
+    // the chunk before the remainder is about to be allocated
+    uint8_t* next_chunk = (uint8_t*)chunk + size;
+    set_free(arena, next_chunk, rem, preamble & PREAMB_ZEROED);
+    list_insert(arena, next_chunk);
+    return size;
+}
+
+/**
+ * @brief Take a chunk off an arena's free lists and mark it allocated. The
+ * caller must hold the arena's lock.
+ *
+ * @param arena Arena to allocate from
+ * @param chunk_size Size of chunk to allocate (multiple of ALIGNMENT)
+ * @param alignment Alignment of the user pointer (at least ALIGNMENT)
+ * @param zeroed If not NULL, set to whether the user memory is all zero
+ * @return void* Pointer to user memory, or NULL if the heap cannot grow
+ */
+static void* heap_alloc(arena_t* arena, size_t chunk_size, size_t alignment,
+                        bool* zeroed)
+{
+    /* Look for free chunk */
+    // an aligned chunk might start up to `alignment - ALIGNMENT` bytes in
+    void* chunk = get_free_chunk(arena, chunk_size + alignment - ALIGNMENT);
+    if (chunk == NULL)
+    {
+        dprintf("Memory could not be allocated\n");
+        return NULL;
+    }
+
+    uint8_t* ptr =
+        (uint8_t*)align_up((uintptr_t)chunk + HEADER_SIZE, alignment);
+    size_t lead = ptr - HEADER_SIZE - (uint8_t*)chunk;
+    preamble_t preamble = *get_preamble(arena, chunk);
+    preamble_t prev_free = preamble & PREAMB_PREV_FREE;
+    preamble_t zero = preamble & PREAMB_ZEROED;
+    if (lead > 0)
+    {
+        // give the space in front of the aligned chunk back (it is at least
+        // ALIGNMENT = MIN_CHUNK bytes long)
+        uint8_t* aligned_chunk = ptr - HEADER_SIZE;
+        size_t size = get_chunk_size(arena, chunk);
+        clear_wide(arena, chunk, size);
+        set_size(arena, aligned_chunk, size - lead, zero);
+        set_free(arena, chunk, lead, prev_free | zero);
+        list_insert(arena, chunk);
+        chunk = aligned_chunk;
+        prev_free = PREAMB_PREV_FREE;
+    }
+
+    /* Allocate in free chunk */
+    chunk_size = split_chunk(arena, chunk, chunk_size);
+
+    /* Add preamble and set to 'allocated' */
+    set_allocated(arena, chunk, chunk_size, prev_free);
+
+    if (zeroed != NULL)
+    {
+        *zeroed = zero != 0;
+        if (zero)
+        {
+            // only the links and the footer were written to the chunk
+            memset(get_links(chunk), 0, 2 * sizeof(link_t));
+#ifndef OOB_METADATA
+            *get_footer(arena, (uint8_t*)chunk + chunk_size) = 0;
+#endif
+        }
+    }
+
+    return ptr;
+}
+
+/**
+ * @brief Allocate `count` chunks of the same size, carving up to MAX_RUN bytes
+ * of them out of a single free chunk. The caller must hold the arena's lock.
+ *
+ * @param arena Arena to allocate from
+ * @param chunk_size Size of the chunks (multiple of ALIGNMENT)
+ * @param ptrs Filled with pointers to user memory
+ * @param count Number of chunks to allocate
+ * @return number of chunks allocated, less than `count` if the heap cannot grow
+ */
+static size_t heap_alloc_batch(arena_t* arena, size_t chunk_size, void** ptrs,
+                               size_t count)
+{
+    size_t n = 0;
+    while (n < count)
+    {
+        // runs of up to half the largest chunk leave a size class above them
+        // to find a free chunk in
+        size_t run = count - n;
+        if (run > MAX_RUN / chunk_size)
+        {
+            run = MAX_RUN > chunk_size ? MAX_RUN / chunk_size : 1;
+        }
+
+        uint8_t* chunk = get_free_chunk(arena, run * chunk_size);
+        if (chunk == NULL)
+        {
+            dprintf("Memory could not be allocated\n");
+            break;
+        }
+        preamble_t prev_free = *get_preamble(arena, chunk) & PREAMB_PREV_FREE;
+        size_t size = split_chunk(arena, chunk, run * chunk_size);
+
+        // the last chunk also gets what was too small to split off
+        for (size_t i = 0; i < run; i++)
+        {
+            size_t this_size = i < run - 1 ? chunk_size : size;
+            set_allocated(arena, chunk, this_size, i == 0 ? prev_free : 0);
+            ptrs[n++] = chunk + HEADER_SIZE;
+            chunk += chunk_size;
+            size -= chunk_size;
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Mark an allocated chunk free and merge it back into its arena's free
+ * lists, purging the arena now and then. The caller must hold the arena's
+ * lock.
+ *
+ * @param arena Arena the chunk belongs to
+ * @param chunk Allocated heap chunk
+ */
+static void heap_free(arena_t* arena, void* chunk)
+{
+    preamble_t* preamble = get_preamble(arena, chunk);
+
+    // set "free" bit to 0
+    *preamble = *preamble & ~PREAMB_ALLOC_MASK;
+
+    // combine free chunks together, then make the result available again
+    chunk = combine_chunks(arena, chunk);
+    list_insert(arena, chunk);
+    arena_tick(arena);
+}
+
+/**
+ * @brief Resize an allocated chunk without moving it: grow it into the free
+ * chunk right after it, or give its tail back. The caller must hold the
+ * arena's lock.
+ *
+ * @param arena Arena the chunk belongs to
+ * @param chunk Allocated heap chunk
+ * @param size Number of bytes the user needs
+ * @return true if the chunk now holds `size` bytes, false if it is unchanged
+ */
+static bool heap_resize(arena_t* arena, void* chunk, size_t size)
+{
+    // requests that large belong in their own mapping
+    if (size > __atomic_load_n(&mmap_threshold_g, __ATOMIC_RELAXED))
+    {
+        return false;
+    }
+
+    size_t new_size = align_up(size + HEADER_SIZE, ALIGNMENT);
+    if (new_size < MIN_CHUNK)
+    {
+        new_size = MIN_CHUNK;
+    }
+    preamble_t preamble = *get_preamble(arena, chunk);
+    size_t chunk_size = get_size(preamble);
+
+    if (new_size > chunk_size)
+    {
+        // the sentinel after the last chunk is allocated, so this stays in
+        // the heap
+        uint8_t* next_chunk = (uint8_t*)chunk + chunk_size;
+        if (is_allocated(*get_preamble(arena, next_chunk)))
+        {
+            return false;
+        }
+        size_t next_size = get_chunk_size(arena, next_chunk);
+        if (chunk_size + next_size < new_size)
+        {
+            return false;
+        }
+
+        dprintf("Growing %p (%zuB) into %p (%zuB)\n", chunk, chunk_size,
+                next_chunk, next_size);
+        list_remove(arena, next_chunk);
+        clear_wide(arena, next_chunk, next_size);
+        chunk_size += next_size;
+    }
+
+    // a tail too small to be a chunk stays with this one
+    size_t rem = chunk_size - new_size;
+    if (rem < MIN_CHUNK)
+    {
+        new_size = chunk_size;
+    }
+    set_allocated(arena, chunk, new_size, preamble & PREAMB_PREV_FREE);
+
+    if (rem >= MIN_CHUNK)
+    {
+        // free the tail as a chunk of its own, which merges it with the chunk
+        // after it if that one is free
+        uint8_t* tail = (uint8_t*)chunk + new_size;
+        set_size(arena, tail, rem, PREAMB_ALLOC_MASK);
+        heap_free(arena, tail);
+    }
+    return true;
+}
+
+#ifdef SLAB
+/**
+ * @brief Find the slab a pointer is a slot of
+ *
+ * @param arena Arena whose range holds `ptr`
+ * @param ptr Pointer to user memory
+ * @return slab_t* Slab holding `ptr`, or NULL if `ptr` is not a slab slot
+ */
+static inline slab_t* slab_of(arena_t* arena, void* ptr)
+{
+    // mapped chunks end up here as well without OOB_METADATA, they are out
+    // of the arena's range or in a part of it that holds no slab
+    size_t index = ((uintptr_t)ptr / SLAB_SIZE) -
+                   ((uintptr_t)arena->start / SLAB_SIZE);
+    if (index >= SLAB_MAP_WORDS * 64)
+    {
+        return NULL;
+    }
+    uint64_t word =
+        __atomic_load_n(&arena->slab_map[index / 64], __ATOMIC_RELAXED);
+    if ((word & (1ULL << (index % 64))) == 0)
+    {
+        return NULL;
+    }
+    return (slab_t*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+/**
+ * @brief Set or clear the bit of a slab in its arena's `slab_map`
+ */
+static inline void slab_map_set(arena_t* arena, slab_t* slab, bool is_slab)
+{
+    size_t index = ((uintptr_t)slab / SLAB_SIZE) -
+                   ((uintptr_t)arena->start / SLAB_SIZE);
+    uint64_t bit = 1ULL << (index % 64);
+
+    if (is_slab)
+    {
+        __atomic_fetch_or(&arena->slab_map[index / 64], bit, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_fetch_and(&arena->slab_map[index / 64], ~bit,
+                           __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Add a slab to the front of its arena's list for its slot size
+ */
+static inline void slab_link(arena_t* arena, slab_t* slab)
+{
+    slab_t** head = &arena->slabs[slab->slot_size / ALIGNMENT - 1];
+
+    slab->next = *head;
+    slab->prev = NULL;
+    if (*head != NULL)
+    {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+/**
+ * @brief Remove a slab from its arena's list for its slot size
+ */
+static inline void slab_unlink(arena_t* arena, slab_t* slab)
+{
+    if (slab->prev != NULL)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        arena->slabs[slab->slot_size / ALIGNMENT - 1] = slab->next;
+    }
+    if (slab->next != NULL)
+    {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/**
+ * @brief Carve a new slab out of the heap. The caller must hold the arena's
+ * lock.
+ *
+ * @param arena Arena to allocate from
+ * @param slot_size Size of the slab's slots (multiple of ALIGNMENT)
+ * @return slab_t* New slab with all slots free, or NULL if the heap cannot grow
+ */
+static slab_t* slab_create(arena_t* arena, size_t slot_size)
+{
+    slab_t* slab = heap_alloc(
+        arena, align_up(SLAB_SIZE + HEADER_SIZE, ALIGNMENT), SLAB_SIZE, NULL);
+    if (slab == NULL)
+    {
+        return NULL;
+    }
+
+    // the header takes up the first slots
+    size_t first = (sizeof(slab_t) + slot_size - 1) / slot_size;
+    size_t slots = SLAB_SIZE / slot_size;
+
+    slab->slot_size = slot_size;
+    slab->free = slots - first;
+    stats_free(arena, slot_size, slab->free * slot_size);
+    for (size_t i = 0; i < SLAB_WORDS; i++)
+    {
+        size_t lo = i * 64;
+        uint64_t bits = ~0ULL;
+        if (lo + 64 > slots)
+        {
+            bits = lo >= slots ? 0 : bits >> (lo + 64 - slots);
+        }
+        if (lo < first)
+        {
+            bits &= first - lo >= 64 ? 0 : ~0ULL << (first - lo);
+        }
+        slab->free_bits[i] = bits;
+    }
+
+    dprintf("Slab of %zuB slots at %p\n", slot_size, slab);
+    slab_map_set(arena, slab, true);
+    slab_link(arena, slab);
+    return slab;
+}
+
+/**
+ * @brief Take a free slot from one of an arena's slabs, creating a slab when
+ * there is none. The caller must hold the arena's lock.
+ *
+ * @param arena Arena to allocate from
+ * @param slot_size Size of the slot (multiple of ALIGNMENT, at most MAX_ALLOC)
+ * @return void* Pointer to the slot, or NULL if the heap cannot grow
+ */
+static void* slab_alloc(arena_t* arena, size_t slot_size)
+{
+    slab_t* slab = arena->slabs[slot_size / ALIGNMENT - 1];
+    if (slab == NULL)
+    {
+        slab = slab_create(arena, slot_size);
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    // listed slabs have a free slot
+    size_t word = 0;
+    while (slab->free_bits[word] == 0)
+    {
+        word++;
+    }
+    size_t bit = __builtin_ctzll(slab->free_bits[word]);
+    slab->free_bits[word] &= ~(1ULL << bit);
+    stats_free(arena, slot_size, -slot_size);
+
+    if (--slab->free == 0)
+    {
+        slab_unlink(arena, slab);
+    }
+    return (uint8_t*)slab + (word * 64 + bit) * slot_size;
+}
+
+/**
+ * @brief Take `count` free slots, emptying one slab's bitmap before moving to
+ * the next. The caller must hold the arena's lock.
+ *
+ * @param arena Arena to allocate from
+ * @param slot_size Size of the slots (multiple of ALIGNMENT, at most MAX_ALLOC)
+ * @param ptrs Filled with pointers to the slots
+ * @param count Number of slots to take
+ * @return number of slots taken, less than `count` if the heap cannot grow
+ */
+static size_t slab_alloc_batch(arena_t* arena, size_t slot_size, void** ptrs,
+                               size_t count)
+{
+    size_t n = 0;
+    while (n < count)
+    {
+        size_t taken = n;
+        slab_t* slab = arena->slabs[slot_size / ALIGNMENT - 1];
+        if (slab == NULL)
+        {
+            slab = slab_create(arena, slot_size);
+            if (slab == NULL)
+            {
+                break;
+            }
+        }
+
+        for (size_t word = 0; word < SLAB_WORDS && n < count; word++)
+        {
+            uint64_t bits = slab->free_bits[word];
+            while (bits != 0 && n < count)
+            {
+                size_t bit = __builtin_ctzll(bits);
+                bits &= bits - 1;
+                ptrs[n++] = (uint8_t*)slab + (word * 64 + bit) * slot_size;
+                slab->free--;
+            }
+            slab->free_bits[word] = bits;
+        }
+        stats_free(arena, slot_size, -(n - taken) * slot_size);
+
+        if (slab->free == 0)
+        {
+            slab_unlink(arena, slab);
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Give a slot back to its slab. The caller must hold the arena's lock.
+ *
+ * @param arena Arena the slab belongs to
+ * @param slab Slab holding `ptr`
+ * @param ptr Slot to free
+ */
+static void slab_free(arena_t* arena, slab_t* slab, void* ptr)
+{
+    size_t slot = ((uint8_t*)ptr - (uint8_t*)slab) / slab->slot_size;
+    uint64_t bit = 1ULL << (slot % 64);
+
+    if (slab->free_bits[slot / 64] & bit)
+    {
+        dprintf("Slot at %p is already free\n", ptr);
+        return;
+    }
+    slab->free_bits[slot / 64] |= bit;
+    stats_free(arena, slab->slot_size, slab->slot_size);
+
+    if (slab->free++ == 0)
+    {
+        slab_link(arena, slab);
+    }
+
+    // keep the last slab of a size around, it would be created again soon
+    size_t first = (sizeof(slab_t) + slab->slot_size - 1) / slab->slot_size;
+    if (slab->free == SLAB_SIZE / slab->slot_size - first &&
+        (slab->next != NULL || slab->prev != NULL))
+    {
+        dprintf("Releasing slab at %p\n", slab);
+        stats_free(arena, slab->slot_size,
+                   -(size_t)slab->free * slab->slot_size);
+        slab_unlink(arena, slab);
+        slab_map_set(arena, slab, false);
+        heap_free(arena, (uint8_t*)slab - HEADER_SIZE);
+    }
+}
+
+#endif
+
+/**
+ * @brief Free a slab slot or a heap chunk of an arena. The caller must hold
+ * the arena's lock.
+ *
+ * @param arena Arena the memory belongs to
+ * @param ptr Pointer to user memory
+ */
+static void arena_free(arena_t* arena, void* ptr)
+{
+#ifdef SLAB
+    slab_t* slab = slab_of(arena, ptr);
+    if (slab != NULL)
+    {
+        slab_free(arena, slab, ptr);
+        return;
+    }
+#endif
+    heap_free(arena, (uint8_t*)ptr - HEADER_SIZE);
+}
+
+/**
+ * @brief Hand a chunk back to the arena that owns it without taking its lock,
+ * unless no thread of the arena is left to. The caller must not hold the lock
+ * of an arena.
+ *
+ * @param arena Arena the chunk belongs to
+ * @param ptr Pointer to user memory of an allocated chunk
+ */
+static void remote_free(arena_t* arena, void* ptr)
+{
+    void* head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+    do
+    {
+        *(void**)ptr = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, ptr,
+                                          true, __ATOMIC_SEQ_CST,
+                                          __ATOMIC_RELAXED));
+
+    // the arena's last thread has exited, or is exiting and may have drained
+    // the stack before the push: nobody else is going to
+    if (__atomic_load_n(&arena->threads, __ATOMIC_SEQ_CST) == 0)
+    {
+        pthread_mutex_lock(&arena->lock);
+        drain_remote_frees(arena);
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+/**
+ * @brief Free every chunk other threads pushed on an arena's remote stack.
+ * The caller must hold the arena's lock.
+ *
+ * @param arena Arena to drain
+ */
+static void drain_remote_frees(arena_t* arena)
+{
+    if (__atomic_load_n(&arena->remote_frees, __ATOMIC_SEQ_CST) == NULL)
+    {
+        return;
+    }
+
+    // take the whole stack at once, pushes after this start a new one
+    void* ptr = __atomic_exchange_n(&arena->remote_frees, NULL,
+                                    __ATOMIC_ACQUIRE);
+    while (ptr != NULL)
+    {
+        void* next = *(void**)ptr;
+        arena_free(arena, ptr);
+        ptr = next;
+    }
+}
+
+/**
+ * @brief Give every chunk cached by an exiting thread back to the heap
+ *
+ * @param arg The thread's `tcache_t`
+ */
+static void tcache_destroy(void* arg)
+{
+    tcache_t* tcache = arg;
+
+    tcache->state = TCACHE_DEAD;
+    for (size_t bin = 0; bin < TCACHE_BINS; bin++)
+    {
+        tcache_flush(tcache, bin, tcache->counts[bin]);
+    }
+
+    // what other threads freed would otherwise wait for the arena's next
+    // allocation, which never comes if this was its last thread
+    arena_t* arena = tcache->arena;
+    if (arena != NULL)
+    {
+        pthread_mutex_lock(&arena->lock);
+        __atomic_fetch_sub(&arena->threads, 1, __ATOMIC_SEQ_CST);
+        drain_remote_frees(arena);
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    pthread_mutex_lock(&threads_lock_g);
+    for (size_t op = 0; op < STAT_OPS; op++)
+    {
+        __atomic_fetch_add(&exited_ops_g[op], tcache->ops[op],
+                           __ATOMIC_RELAXED);
+    }
+    if (tcache->prev_thread != NULL)
+    {
+        tcache->prev_thread->next_thread = tcache->next_thread;
+    }
+    else
+    {
+        threads_g = tcache->next_thread;
+    }
+    if (tcache->next_thread != NULL)
+    {
+        tcache->next_thread->prev_thread = tcache->prev_thread;
+    }
+    pthread_mutex_unlock(&threads_lock_g);
+}
+
+static void tcache_init(void)
+{
+    pthread_key_create(&tcache_key_g, tcache_destroy);
+}
+
+/**
+ * @brief Make sure the cache is emptied when the calling thread exits, and
+ * list it for allocm_stats() until then
+ *
+ * @param tcache Calling thread's cache
+ */
+static inline void tcache_register(tcache_t* tcache)
+{
+    if (tcache->state == TCACHE_UNUSED)
+    {
+        pthread_once(&tcache_once_g, tcache_init);
+        pthread_setspecific(tcache_key_g, tcache);
+        tcache->state = TCACHE_ACTIVE;
+
+        pthread_mutex_lock(&threads_lock_g);
+        tcache->next_thread = threads_g;
+        if (threads_g != NULL)
+        {
+            threads_g->prev_thread = tcache;
+        }
+        threads_g = tcache;
+        pthread_mutex_unlock(&threads_lock_g);
+    }
+}
+
+/**
+ * @brief Count calls of the calling thread for allocm_stats(), in its cache
+ * while it has one. The paths through the cache count theirs themselves;
+ * this is kept out of line so it does not weigh on the paths that call it.
+ *
+ * @param op Kind of call
+ * @param n Number of calls (or blocks, for the batch calls)
+ */
+__attribute__((noinline)) static void stats_count(stat_op_t op, size_t n)
+{
+    tcache_t* tcache = &tcache_g;
+    tcache_register(tcache);
+    if (tcache->state == TCACHE_ACTIVE)
+    {
+        stats_add(&tcache->ops[op], n);
+    }
+    else
+    {
+        __atomic_fetch_add(&exited_ops_g[op], n, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Let the arena of a thread whose calls are served by its cache look
+ * at the clock (see "Purging"), unless another thread holds its lock
+ *
+ * @param tcache Calling thread's cache
+ */
+__attribute__((noinline)) static void tcache_decay(tcache_t* tcache)
+{
+    tcache->decay_ops = 0;
+    arena_t* arena = tcache->arena;
+    if (arena != NULL && pthread_mutex_trylock(&arena->lock) == 0)
+    {
+        arena_decay(arena);
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+/**
+ * @brief Pop a chunk from the calling thread's cache, refilling the bin from
+ * the heap when it is empty
+ *
+ * @param tcache Calling thread's cache
+ * @param chunk_size Size of chunk to allocate (at most TCACHE_MAX_CHUNK), or
+ * of slot if at most MAX_ALLOC
+ * @return void* Pointer to user memory, or NULL if the heap cannot grow
+ */
+static void* tcache_get(tcache_t* tcache, size_t chunk_size)
+{
+    size_t bin = chunk_size / ALIGNMENT - 1;
+
+    if (tcache->counts[bin] == 0)
+    {
+        tcache_register(tcache);
+
+        size_t batch = TCACHE_FILL_BYTES / chunk_size;
+        batch = batch < 1 ? 1 : batch > TCACHE_BATCH ? TCACHE_BATCH : batch;
+
+        dprintf("Refilling %zu chunks of %zuB\n", batch, chunk_size);
+        void* ptrs[TCACHE_BATCH];
+        arena_t* arena = thread_arena(tcache);
+        pthread_mutex_lock(&arena->lock);
+        drain_remote_frees(arena);
+#ifdef SLAB
+        batch = chunk_size <= MAX_ALLOC
+                    ? slab_alloc_batch(arena, chunk_size, ptrs, batch)
+                    : heap_alloc_batch(arena, chunk_size, ptrs, batch);
+#else
+        batch = heap_alloc_batch(arena, chunk_size, ptrs, batch);
+#endif
+        arena_tick(arena);
+        pthread_mutex_unlock(&arena->lock);
+
+        // the first chunks are handed out first
+        for (size_t i = batch; i-- > 0;)
+        {
+            *(void**)ptrs[i] = tcache->entries[bin];
+            tcache->entries[bin] = ptrs[i];
+        }
+        tcache->counts[bin] = batch;
+
+        if (tcache->counts[bin] == 0)
+        {
+            return NULL;
+        }
+    }
+
+    void* ptr = tcache->entries[bin];
+    tcache->entries[bin] = *(void**)ptr;
+    tcache->counts[bin]--;
+    stats_add(&tcache->ops[STAT_ALLOCS], 1);
+    if (++tcache->decay_ops == TCACHE_DECAY_OPS)
+    {
+        tcache_decay(tcache);
+    }
+    return ptr;
+}
+
+/**
+ * @brief Push a chunk onto the calling thread's cache, giving a batch back to
+ * the heap when the bin overflows
+ *
+ * @param tcache Calling thread's cache
+ * @param ptr Pointer to user memory of an allocated chunk
+ * @param chunk_size Size of the chunk (at most TCACHE_MAX_CHUNK)
+ */
+static void tcache_put(tcache_t* tcache, void* ptr, size_t chunk_size)
+{
+    size_t bin = chunk_size / ALIGNMENT - 1;
+
+    tcache_register(tcache);
+    *(void**)ptr = tcache->entries[bin];
+    tcache->entries[bin] = ptr;
+    stats_add(&tcache->ops[STAT_FREES], 1);
+    if (++tcache->counts[bin] > TCACHE_COUNT)
+    {
+        tcache_flush(tcache, bin, TCACHE_BATCH);
+    }
+    else if (++tcache->decay_ops == TCACHE_DECAY_OPS)
+    {
+        tcache_decay(tcache);
+    }
+}
+
+/**
+ * @brief Give `count` chunks from a bin of the cache back to the heap
+ *
+ * @param tcache Cache to flush
+ * @param bin Bin to flush
+ * @param count Number of chunks to give back (at most the bin's count)
+ */
+static void tcache_flush(tcache_t* tcache, size_t bin, size_t count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    dprintf("Flushing %zu chunks of %zuB\n", count, (bin + 1) * ALIGNMENT);
+    arena_t* arena = tcache->arena;
+    pthread_mutex_lock(&arena->lock);
+    for (size_t i = 0; i < count; i++)
+    {
+        void* ptr = tcache->entries[bin];
+        tcache->entries[bin] = *(void**)ptr;
+        arena_free(arena, ptr);
+    }
+    pthread_mutex_unlock(&arena->lock);
+    tcache->counts[bin] -= count;
+}
+
+/**
+ * @brief Get the size of the chunk, or slab slot, that holds `size` bytes
+ *
+ * @param size Number of bytes requested by the user (at most the threshold)
+ * @param slab Whether the request is served from a slab
+ * @return size of the chunk or slot
+ */
+static inline size_t request_size(size_t size, bool slab)
+{
+    // the preamble and the chunk are multiples of ALIGNMENT
+    size_t chunk_size = align_up(size + (slab ? 0 : HEADER_SIZE), ALIGNMENT);
+    if (chunk_size < MIN_CHUNK)
+    {
+        // a 0B request without preamble
+        chunk_size = MIN_CHUNK;
+    }
+    return chunk_size;
+}
+
+/**
+ * @brief Allocate `size` bytes aligned to `alignment`, for `allocm()`,
+ * `allocm_aligned()` and `callocm()`
+ *
+ * @param size Number of bytes to allocate
+ * @param alignment Required alignment, must be a power of 2
+ * @param zero Whether the memory must be cleared. Memory known to be zero
+ * (fresh from the system) is not cleared again.
+ * @return void* Pointer to user memory, or NULL
+ */
+static void* allocm_internal(size_t size, size_t alignment, bool zero)
+{
+    dprintf("size = %zu, alignment = %zu\n", size, alignment);
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        dprintf("Alignment (%zu) is not a power of 2\n", alignment);
+        return NULL;
+    }
+    if (alignment < ALIGNMENT)
+    {
+        alignment = ALIGNMENT;
+    }
+
+    // sampled requests are mapped, new mappings are zero
+    tcache_t* tcache = &tcache_g;
+    tcache->sample_left -= size;
+    if (tcache->sample_left < 0 && sample_due(tcache))
+    {
+        void* ptr = alloc_sampled(tcache, size, alignment);
+        stats_count(STAT_ALLOCS, ptr != NULL);
+        return ptr;
+    }
+
+#ifdef BUDDY
+    // powers of two get a block of exactly their size (see "Buddy mode")
+    if (size >= BUDDY_MIN && size <= BUDDY_MAX && (size & (size - 1)) == 0 &&
+        alignment <= size)
+    {
+        bool zeroed;
+        uint8_t* ptr =
+            buddy_alloc(thread_arena(tcache), __builtin_ctzll(size), &zeroed);
+        if (ptr != NULL)
+        {
+            stats_count(STAT_ALLOCS, 1);
+            if (zero)
+            {
+                if (!zeroed)
+                {
+                    memset(ptr, 0, size);
+                }
+            }
+#ifdef CLEAN_MEMORY
+            else
+            {
+                memset(ptr, 0xAA, size);
+            }
+#endif
+            return ptr;
+        }
+    }
+#endif
+
+    // big requests skip the heap entirely, and so do alignments that would
+    // need more padding than a preamble can describe. New mappings are zero
+    if (size > __atomic_load_n(&mmap_threshold_g, __ATOMIC_RELAXED) ||
+        align_up(size + HEADER_SIZE, ALIGNMENT) + alignment - ALIGNMENT >
+            PREAMB_SIZE_MASK)
+    {
+        void* ptr = alloc_mapped(size, alignment, false);
+        stats_count(STAT_ALLOCS, ptr != NULL);
+        return ptr;
+    }
+
+#ifdef SLAB
+    // tiny requests get a slab slot, without preamble
+    bool slab = size <= MAX_ALLOC && alignment == ALIGNMENT;
+#else
+    bool slab = false;
+#endif
+    size_t chunk_size = request_size(size, slab);
+
+    uint8_t* ptr;
+    bool zeroed = false;
+    if (alignment == ALIGNMENT && chunk_size <= TCACHE_MAX_CHUNK &&
+        tcache->state != TCACHE_DEAD)
+    {
+        ptr = tcache_get(tcache, chunk_size); // counts it
+    }
+    else
+    {
+        arena_t* arena = thread_arena(tcache);
+        pthread_mutex_lock(&arena->lock);
+        drain_remote_frees(arena);
+#ifdef SLAB
+        if (slab)
+        {
+            ptr = slab_alloc(arena, chunk_size);
+        }
+        else
+#endif
+        {
+            ptr = heap_alloc(arena, chunk_size, alignment,
+                             zero ? &zeroed : NULL);
+        }
+        arena_tick(arena);
+        pthread_mutex_unlock(&arena->lock);
+        stats_count(STAT_ALLOCS, ptr != NULL);
+    }
+    if (ptr == NULL)
+    {
+        // the arena's range is used up, which does not limit mappings
+        ptr = alloc_mapped(size, alignment, false);
+        stats_count(STAT_ALLOCS, ptr != NULL);
+        return ptr;
+    }
+
+    if (zero)
+    {
+        // libc's memset is vectorised already
+        if (!zeroed)
+        {
+            dprintf("Clearing user's memory\n");
+            memset(ptr, 0, size);
+        }
+    }
+#ifdef CLEAN_MEMORY
+    else
+    {
+        dprintf("Filling user's memory\n");
+        for (size_t i = 0; i < size; i++)
+        {
+            ptr[i] = 0xAA;
+        }
+    }
+#endif
+
+    dprintf("Allocating %zu Bytes at %p\n", size, ptr);
+    return ptr;
+}
+
+/**
+ * @brief Write out the buffered trace records. The caller must hold the trace
+ * lock.
+ */
+static void trace_flush(void)
+{
+    size_t done = 0;
+    while (done < trace_len_g)
+    {
+        ssize_t n = write(trace_fd_g, trace_buf_g + done, trace_len_g - done);
+        if (n <= 0)
+        {
+            dprintf("Could not write the trace, stopping it\n");
+            close(trace_fd_g);
+            __atomic_store_n(&trace_fd_g, -1, __ATOMIC_RELAXED);
+            break;
+        }
+        done += n;
+    }
+    trace_len_g = 0;
+}
+
+static void trace_exit(void)
+{
+    pthread_mutex_lock(&trace_lock_g);
+    if (trace_fd_g >= 0)
+    {
+        trace_flush();
+    }
+    pthread_mutex_unlock(&trace_lock_g);
+}
+
+/**
+ * @brief Start tracing to the file named by ALLOCM_TRACE, if it is set, before
+ * the program's first allocation
+ */
+__attribute__((constructor)) static void trace_init(void)
+{
+    const char* path = getenv("ALLOCM_TRACE");
+    if (path == NULL || *path == '\0')
+    {
+        return;
+    }
+
+    // a program exec'd by the traced process, as a wrapper script does, takes
+    // the trace over; the processes it starts would only truncate it
+    char pid[24];
+    snprintf(pid, sizeof(pid), "%ld", (long)getpid());
+    const char* owner = getenv("ALLOCM_TRACE_PID");
+    if (owner != NULL && strcmp(owner, pid) != 0)
+    {
+        return;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        dprintf("Could not open trace %s\n", path);
+        return;
+    }
+    // an empty trace is still one
+    if (write(fd, TRACE_MAGIC, TRACE_MAGIC_LEN) != TRACE_MAGIC_LEN)
+    {
+        dprintf("Could not write trace %s\n", path);
+        close(fd);
+        return;
+    }
+    setenv("ALLOCM_TRACE_PID", pid, 1);
+    __atomic_store_n(&trace_fd_g, fd, __ATOMIC_RELAXED);
+    atexit(trace_exit);
+}
+
+/**
+ * @brief Take every lock before fork(), so that the child does not inherit
+ * one held by a thread it does not have. Locks are taken in the order the
+ * allocator nests them: trace, samples, arenas, threads.
+ */
+static void fork_prepare(void)
+{
+    pthread_mutex_lock(&trace_lock_g);
+    if (trace_fd_g >= 0)
+    {
+        // the child drops the buffer, and the parent may not exit()
+        trace_flush();
+    }
+    pthread_mutex_lock(&samples_lock_g);
+    fork_arenas_g = __atomic_load_n(&num_arenas_g, __ATOMIC_ACQUIRE);
+    for (size_t a = 0; a < fork_arenas_g; a++)
+    {
+        pthread_mutex_lock(&arenas_g[a].lock);
+    }
+    pthread_mutex_lock(&threads_lock_g);
+}
+
+static void fork_parent(void)
+{
+    pthread_mutex_unlock(&threads_lock_g);
+    for (size_t a = fork_arenas_g; a-- > 0;)
+    {
+        pthread_mutex_unlock(&arenas_g[a].lock);
+    }
+    pthread_mutex_unlock(&samples_lock_g);
+    pthread_mutex_unlock(&trace_lock_g);
+}
+
+/**
+ * @brief Release the locks in the child, which stops tracing: its records
+ * would be mixed up with the parent's in the same file
+ */
+static void fork_child(void)
+{
+    if (trace_fd_g >= 0)
+    {
+        close(trace_fd_g);
+        __atomic_store_n(&trace_fd_g, -1, __ATOMIC_RELAXED);
+        trace_len_g = 0;
+    }
+    fork_parent();
+}
+
+__attribute__((constructor)) static void fork_init(void)
+{
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+/**
+ * @brief Add a record to the trace (see trace.h for the fields each operation
+ * has). The caller must hold the trace lock.
+ *
+ * @param op Operation, one of the TRACE_* opcodes
+ * @param ptr Pointer passed to freem() or reallocm()
+ * @param size Number of bytes requested
+ * @param alignment Alignment requested from allocm_aligned()
+ * @param result Pointer returned to the user
+ */
+static void trace_append(uint8_t op, const void* ptr, size_t size,
+                         size_t alignment, const void* result)
+{
+    // the caller looked without the lock, the trace may have stopped since
+    if (__atomic_load_n(&trace_fd_g, __ATOMIC_RELAXED) < 0)
+    {
+        return;
+    }
+    if (trace_len_g + TRACE_MAX_RECORD > TRACE_BUF_SIZE)
+    {
+        trace_flush();
+    }
+
+    uint8_t* buf = trace_buf_g + trace_len_g;
+    size_t n = 0;
+    buf[n++] = op;
+    if (op == TRACE_REALLOC || op == TRACE_FREE)
+    {
+        n += trace_put_ptr(buf + n, ptr, &trace_last_g);
+    }
+    if (op != TRACE_FREE)
+    {
+        n += trace_put(buf + n, size);
+    }
+    if (op == TRACE_ALIGNED)
+    {
+        n += trace_put(buf + n, alignment);
+    }
+    if (op != TRACE_FREE)
+    {
+        n += trace_put_ptr(buf + n, result, &trace_last_g);
+    }
+    trace_len_g += n;
+}
+
+/**
+ * @brief Check if calls are to be recorded. They are not while the thread
+ * takes a sample: backtrace() may allocate, and reallocm() holds the trace
+ * lock around the move that took the sample.
+ */
+static inline bool tracing(void)
+{
+    return __atomic_load_n(&trace_fd_g, __ATOMIC_RELAXED) >= 0 &&
+           !tcache_g.sampling;
+}
+
+/**
+ * @brief Add a record to the trace, taking the trace lock
+ */
+static void trace_record(uint8_t op, const void* ptr, size_t size,
+                         size_t alignment, const void* result)
+{
+    pthread_mutex_lock(&trace_lock_g);
+    trace_append(op, ptr, size, alignment, result);
+    pthread_mutex_unlock(&trace_lock_g);
+}
+
+void* allocm(size_t size)
+{
+    void* ptr = allocm_internal(size, ALIGNMENT, false);
+    if (tracing())
+    {
+        trace_record(TRACE_ALLOC, NULL, size, 0, ptr);
+    }
+    return ptr;
+}
+
+void* allocm_aligned(size_t size, size_t alignment)
+{
+    void* ptr = allocm_internal(size, alignment, false);
+    if (tracing())
+    {
+        trace_record(TRACE_ALIGNED, NULL, size, alignment, ptr);
+    }
+    return ptr;
+}
+
+void* callocm(size_t count, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total))
+    {
+        dprintf("%zu * %zu Bytes overflows\n", count, size);
+        return NULL;
+    }
+    void* ptr = allocm_internal(total, ALIGNMENT, true);
+    if (tracing())
+    {
+        trace_record(TRACE_CALLOC, NULL, total, 0, ptr);
+    }
+    return ptr;
+}
+
+/**
+ * @brief Allocate `count` blocks of `size` bytes, for `allocm_batch()`
+ *
+ * @param size Number of bytes per block
+ * @param count Number of blocks to allocate
+ * @param ptrs Array of at least `count` pointers, filled with the blocks
+ * @return number of blocks allocated
+ */
+static size_t allocm_batch_internal(size_t size, size_t count, void** ptrs)
+{
+    dprintf("size = %zu, count = %zu\n", size, count);
+
+    size_t n = 0;
+    if (size > __atomic_load_n(&mmap_threshold_g, __ATOMIC_RELAXED))
+    {
+        // every one of them needs its own mapping anyway
+        for (; n < count; n++)
+        {
+            ptrs[n] = alloc_mapped(size, ALIGNMENT, false);
+            if (ptrs[n] == NULL)
+            {
+                break;
+            }
+        }
+        return n;
+    }
+
+#ifdef SLAB
+    bool slab = size <= MAX_ALLOC;
+#else
+    bool slab = false;
+#endif
+    size_t chunk_size = request_size(size, slab);
+
+    // use up what the thread has cached first
+    tcache_t* tcache = &tcache_g;
+    if (chunk_size <= TCACHE_MAX_CHUNK && tcache->state != TCACHE_DEAD)
+    {
+        size_t bin = chunk_size / ALIGNMENT - 1;
+        for (; n < count && tcache->counts[bin] > 0; n++)
+        {
+            ptrs[n] = tcache->entries[bin];
+            tcache->entries[bin] = *(void**)ptrs[n];
+            tcache->counts[bin]--;
+        }
+    }
+
+    if (n < count)
+    {
+        arena_t* arena = thread_arena(tcache);
+        pthread_mutex_lock(&arena->lock);
+        drain_remote_frees(arena);
+#ifdef SLAB
+        if (slab)
+        {
+            n += slab_alloc_batch(arena, chunk_size, ptrs + n, count - n);
+        }
+        else
+#endif
+        {
+            n += heap_alloc_batch(arena, chunk_size, ptrs + n, count - n);
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+#ifdef CLEAN_MEMORY
+    dprintf("Filling user's memory\n");
+    for (size_t i = 0; i < n; i++)
+    {
+        for (size_t j = 0; j < size; j++)
+        {
+            ((uint8_t*)ptrs[i])[j] = 0xAA;
+        }
+    }
+#endif
+
+    return n;
+}
+
+size_t allocm_batch(size_t size, size_t count, void** ptrs)
+{
+    size_t n = allocm_batch_internal(size, count, ptrs);
+    stats_count(STAT_ALLOCS, n);
+    if (tracing())
+    {
+        pthread_mutex_lock(&trace_lock_g);
+        for (size_t i = 0; i < n; i++)
+        {
+            trace_append(TRACE_ALLOC, NULL, size, 0, ptrs[i]);
+        }
+        pthread_mutex_unlock(&trace_lock_g);
+    }
+    return n;
+}
+
+/**
+ * @brief Find where memory passed to `freem()` goes back to. Mapped chunks
+ * are unmapped right away.
+ *
+ * A heap chunk is exactly `request_size()` of any size from the one it was
+ * allocated with up to its usable one, so when the caller knows the size
+ * the chunk's preamble, often far from anything in the cache, is not read
+ * (but in DEBUG builds, which abort if the size does not match it).
+ *
+ * @param ptr Pointer to user memory (not NULL)
+ * @param size Number of bytes the block was allocated with, or SIZE_MAX if
+ * not known
+ * @param slab Set to the slab `ptr` is a slot of, or NULL
+ * @param chunk_size Set to the size of the chunk or slot
+ * @return arena_t* Arena the memory belongs to, or NULL if there is nothing
+ * left to do
+ */
+static inline arena_t* free_lookup(void* ptr, size_t size, slab_t** slab,
+                                   size_t* chunk_size)
+{
+#ifdef BUDDY
+    if (is_buddy(ptr))
+    {
+        buddy_free(ptr);
+        return NULL;
+    }
+#endif
+
+    // chunk starts HEADER_SIZE bytes before user's ptr
+    uint8_t* chunk = (uint8_t*)ptr - HEADER_SIZE;
+    arena_t* arena = arena_of(chunk);
+    if (arena == NULL)
+    {
+        free_mapped(ptr);
+        return NULL;
+    }
+
+#ifdef SLAB
+    // slab slots have no preamble to look at, and hold at most MAX_ALLOC
+    // bytes
+    bool slab_sized = size <= MAX_ALLOC || size == SIZE_MAX;
+    *slab = slab_sized ? slab_of(arena, ptr) : NULL;
+    if (*slab != NULL)
+    {
+        *chunk_size = (*slab)->slot_size;
+        return arena;
+    }
+#else
+    *slab = NULL;
+#endif
+
+    // the size is only trusted for the heap, mapped chunks can lie in the
+    // range arena_of() gives to the main one
+    size_t sized = 0;
+    if (size != SIZE_MAX && chunk >= arena->start && chunk < arena->end)
+    {
+        sized = request_size(size, false);
+#ifndef DEBUG
+        *chunk_size = sized;
+        return arena;
+#endif
+    }
+
+    preamble_t preamble = *get_preamble(arena, chunk);
+    if (!is_allocated(preamble))
+    {
+        // memory not allocated
+        dprintf("Memory at %p is already unallocated (Preamble: %#6X)\n", ptr,
+                preamble);
+        return NULL;
+    }
+
+    *chunk_size = get_size(preamble);
+    if (sized != 0 && sized != *chunk_size)
+    {
+        // smaller than the block was allocated with
+        dprintf("Block at %p is not %zuB, its chunk is %zuB\n", ptr, size,
+                *chunk_size);
+        abort();
+    }
+    if (*chunk_size == 0)
+    {
+        free_mapped(ptr);
+        return NULL;
+    }
+    return arena;
+}
+
+/**
+ * @brief Free memory, for `freem()`, `freem_sized()` and `reallocm()`
+ *
+ * @param ptr Pointer to user memory (not NULL)
+ * @param size Number of bytes the block was allocated with, or SIZE_MAX if
+ * not known
+ */
+static void freem_internal(void* ptr, size_t size)
+{
+    slab_t* slab;
+    size_t chunk_size;
+    arena_t* arena = free_lookup(ptr, size, &slab, &chunk_size);
+    if (arena == NULL)
+    {
+        stats_count(STAT_FREES, 1);
+        return;
+    }
+
+    // only chunks of the thread's own arena can go in its cache, and with
+    // slabs the bins up to MAX_ALLOC only take slots
+#ifdef SLAB
+    bool cacheable = slab != NULL || chunk_size > MAX_ALLOC;
+#else
+    bool cacheable = true;
+#endif
+    tcache_t* tcache = &tcache_g;
+    if (arena != tcache->arena)
+    {
+        remote_free(arena, ptr);
+        stats_count(STAT_FREES, 1);
+    }
+    else if (chunk_size <= TCACHE_MAX_CHUNK && tcache->state != TCACHE_DEAD &&
+             cacheable)
+    {
+        tcache_put(tcache, ptr, chunk_size); // counts it
+    }
+    else
+    {
+        pthread_mutex_lock(&arena->lock);
+        arena_free(arena, ptr);
+        pthread_mutex_unlock(&arena->lock);
+        stats_count(STAT_FREES, 1);
+    }
+}
+
+void freem(void* ptr)
+{
+    dprintf("ptr = %p\n", ptr);
+
+    if (ptr == NULL)
+    {
+        dprintf("Trying to free a NULL pointer\n");
+        return;
+    }
+
+    // recorded first: once it is freed, another thread may get it back
+    if (tracing())
+    {
+        trace_record(TRACE_FREE, ptr, 0, 0, NULL);
+    }
+    freem_internal(ptr, SIZE_MAX);
+}
+
+void freem_sized(void* ptr, size_t size)
+{
+    dprintf("ptr = %p, size = %zu\n", ptr, size);
+
+    if (ptr == NULL)
+    {
+        dprintf("Trying to free a NULL pointer\n");
+        return;
+    }
+
+#ifdef DEBUG
+    size_t usable = allocm_usable_size(ptr);
+    if (size > usable)
+    {
+        dprintf("Block at %p has %zuB, not %zuB\n", ptr, usable, size);
+        abort();
+    }
+#endif
+
+    if (tracing())
+    {
+        trace_record(TRACE_FREE, ptr, 0, 0, NULL);
+    }
+    freem_internal(ptr, size);
+}
+
+void freem_batch(void** ptrs, size_t count)
+{
+    dprintf("count = %zu\n", count);
+
+    if (tracing())
+    {
+        pthread_mutex_lock(&trace_lock_g);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (ptrs[i] != NULL)
+            {
+                trace_append(TRACE_FREE, ptrs[i], 0, 0, NULL);
+            }
+        }
+        pthread_mutex_unlock(&trace_lock_g);
+    }
+
+    // the thread's own arena is locked once for all of its chunks, the
+    // others get theirs through their remote stacks
+    arena_t* own = tcache_g.arena;
+    bool locked = false;
+    size_t freed = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (ptrs[i] == NULL)
+        {
+            continue;
+        }
+        freed++;
+
+        slab_t* slab;
+        size_t chunk_size;
+        arena_t* arena = free_lookup(ptrs[i], SIZE_MAX, &slab, &chunk_size);
+        if (arena == NULL)
+        {
+            continue;
+        }
+        if (arena != own)
+        {
+            // it may take the other arena's lock, never while holding ours
+            if (locked)
+            {
+                pthread_mutex_unlock(&own->lock);
+                locked = false;
+            }
+            remote_free(arena, ptrs[i]);
+            continue;
+        }
+
+        if (!locked)
+        {
+            pthread_mutex_lock(&own->lock);
+            locked = true;
+        }
+#ifdef SLAB
+        if (slab != NULL)
+        {
+            slab_free(own, slab, ptrs[i]);
+            continue;
+        }
+#endif
+        heap_free(own, (uint8_t*)ptrs[i] - HEADER_SIZE);
+    }
+    if (locked)
+    {
+        pthread_mutex_unlock(&own->lock);
+    }
+    stats_count(STAT_FREES, freed);
+}
+
+/**
+ * @brief Resize memory, for `reallocm()`
+ *
+ * @param ptr Pointer to user memory, or NULL
+ * @param size New number of bytes
+ * @return void* Pointer to the resized memory, or NULL
+ */
+static void* reallocm_internal(void* ptr, size_t size)
+{
+    dprintf("ptr = %p, size = %zu\n", ptr, size);
+
+    if (ptr == NULL)
+    {
+        return allocm_internal(size, ALIGNMENT, false);
+    }
+
+#ifdef BUDDY
+    if (is_buddy(ptr))
+    {
+        // a block cannot grow, but keeps a request that still fits
+        size_t usable = buddy_size(ptr);
+        if (size <= usable)
+        {
+            return ptr;
+        }
+        void* new_ptr = allocm_internal(size, ALIGNMENT, false);
+        if (new_ptr == NULL)
+        {
+            return NULL;
+        }
+        dprintf("Moving %p to %p\n", ptr, new_ptr);
+        memcpy(new_ptr, ptr, usable);
+        freem_internal(ptr, SIZE_MAX);
+        return new_ptr;
+    }
+#endif
+
+    // chunk starts HEADER_SIZE bytes before user's ptr
+    uint8_t* chunk = (uint8_t*)ptr - HEADER_SIZE;
+    arena_t* arena = arena_of(chunk);
+    if (arena == NULL)
+    {
+        return realloc_mapped(ptr, size);
+    }
+
+    // bytes of user memory `ptr` has, copied if it has to move
+    size_t usable;
+#ifdef SLAB
+    slab_t* slab = slab_of(arena, ptr);
+    if (slab != NULL)
+    {
+        // a slot cannot grow, but keeps a request that still fits
+        if (size <= slab->slot_size)
+        {
+            return ptr;
+        }
+        usable = slab->slot_size;
+    }
+    else
+#endif
+    {
+        preamble_t preamble = *get_preamble(arena, chunk);
+        if (!is_allocated(preamble))
+        {
+            dprintf("Memory at %p is unallocated (Preamble: %#6X)\n", ptr,
+                    preamble);
+            return NULL;
+        }
+        if (get_size(preamble) == 0)
+        {
+            return realloc_mapped(ptr, size);
+        }
+
+        pthread_mutex_lock(&arena->lock);
+        bool resized = heap_resize(arena, chunk, size);
+        usable = get_size(*get_preamble(arena, chunk)) - HEADER_SIZE;
+        pthread_mutex_unlock(&arena->lock);
+        if (resized)
+        {
+            return ptr;
+        }
+    }
+
+    // no room where it is: move it
+    void* new_ptr = allocm_internal(size, ALIGNMENT, false);
+    if (new_ptr == NULL)
+    {
+        return NULL;
+    }
+    dprintf("Moving %p to %p\n", ptr, new_ptr);
+    memcpy(new_ptr, ptr, usable < size ? usable : size);
+    freem_internal(ptr, SIZE_MAX);
+    return new_ptr;
+}
+
+void* reallocm(void* ptr, size_t size)
+{
+    stats_count(STAT_REALLOCS, 1);
+    if (!tracing())
+    {
+        return reallocm_internal(ptr, size);
+    }
+
+    // the old memory is released within, so the lock is held until the
+    // record is written for no other thread to record getting it first
+    pthread_mutex_lock(&trace_lock_g);
+    void* new_ptr = reallocm_internal(ptr, size);
+    trace_append(TRACE_REALLOC, ptr, size, 0, new_ptr);
+    pthread_mutex_unlock(&trace_lock_g);
+    return new_ptr;
+}
+
+size_t allocm_usable_size(void* ptr)
+{
+    if (ptr == NULL)
+    {
+        return 0;
+    }
+#ifdef BUDDY
+    if (is_buddy(ptr))
+    {
+        return buddy_size(ptr);
+    }
+#endif
+
+    // chunk starts HEADER_SIZE bytes before user's ptr
+    uint8_t* chunk = (uint8_t*)ptr - HEADER_SIZE;
+    arena_t* arena = arena_of(chunk);
+    if (arena != NULL)
+    {
+#ifdef SLAB
+        slab_t* slab = slab_of(arena, ptr);
+        if (slab != NULL)
+        {
+            return slab->slot_size;
+        }
+#endif
+        size_t chunk_size = get_size(*get_preamble(arena, chunk));
+        if (chunk_size != 0)
+        {
+            return chunk_size - HEADER_SIZE;
+        }
+    }
+
+    // a mapped chunk's user memory runs to the end of its mapping
+    uint8_t* header = (uint8_t*)ptr - MAPPED_HEADER;
+    return *(size_t*)header - *(uint32_t*)(header + sizeof(size_t));
+}
+
+region_t* region_create(void)
+{
+    region_t* region = allocm(sizeof(region_t));
+    if (region != NULL)
+    {
+        memset(region, 0, sizeof(*region));
+    }
+    return region;
+}
+
+/**
+ * @brief Carve `size` bytes out of the block after the current one, getting
+ * a new block when the region has none left
+ *
+ * @param region Region whose current block is full
+ * @param size Number of bytes (multiple of ALIGNMENT, at most REGION_LARGE)
+ * @return void* Pointer to the bytes, or NULL if no block could be obtained
+ */
+__attribute__((noinline)) static void* region_refill(region_t* region,
+                                                     size_t size)
+{
+    region_block_t* block =
+        region->current != NULL ? region->current->next : region->blocks;
+    if (block == NULL)
+    {
+        block = allocm(REGION_BLOCK - HEADER_SIZE);
+        if (block == NULL)
+        {
+            return NULL;
+        }
+        block->next = NULL;
+        block->size = REGION_BLOCK - HEADER_SIZE - REGION_HEADER;
+        if (region->current != NULL)
+        {
+            region->current->next = block;
+        }
+        else
+        {
+            region->blocks = block;
+        }
+    }
+
+    dprintf("Carving block %p\n", block);
+    region->current = block;
+    region->next = (uint8_t*)block + REGION_HEADER + size;
+    region->limit = (uint8_t*)block + REGION_HEADER + block->size;
+    return (uint8_t*)block + REGION_HEADER;
+}
+
+void* region_alloc(region_t* region, size_t size)
+{
+    if (size > REGION_LARGE)
+    {
+        // its own block, freed by the next reset
+        region_block_t* block;
+        if (size > SIZE_MAX - REGION_HEADER ||
+            (block = allocm(REGION_HEADER + size)) == NULL)
+        {
+            return NULL;
+        }
+        block->next = region->large;
+        block->size = size;
+        region->large = block;
+        return (uint8_t*)block + REGION_HEADER;
+    }
+
+    // every request gets bytes of its own, as with allocm()
+    size = size == 0 ? ALIGNMENT : align_up(size, ALIGNMENT);
+    if (size <= (size_t)(region->limit - region->next))
+    {
+        void* ptr = region->next;
+        region->next += size;
+        return ptr;
+    }
+    return region_refill(region, size);
+}
+
+/**
+ * @brief Free the blocks of a region's large requests
+ */
+static void region_free_large(region_t* region)
+{
+    region_block_t* block = region->large;
+    while (block != NULL)
+    {
+        region_block_t* next = block->next;
+        freem_sized(block, REGION_HEADER + block->size);
+        block = next;
+    }
+    region->large = NULL;
+}
+
+void region_reset(region_t* region)
+{
+    dprintf("region = %p\n", region);
+
+    region_free_large(region);
+    region->current = NULL;
+    region->next = NULL;
+    region->limit = NULL;
+}
+
+void region_destroy(region_t* region)
+{
+    dprintf("region = %p\n", region);
+
+    if (region == NULL)
+    {
+        return;
+    }
+    region_free_large(region);
+    region_block_t* block = region->blocks;
+    while (block != NULL)
+    {
+        region_block_t* next = block->next;
+        freem_sized(block, REGION_BLOCK - HEADER_SIZE);
+        block = next;
+    }
+    freem_sized(region, sizeof(region_t));
+}
+
+pool_t* pool_create(size_t object_size, size_t alignment)
+{
+    dprintf("object_size = %zu, alignment = %zu\n", object_size, alignment);
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        dprintf("Alignment (%zu) is not a power of 2\n", alignment);
+        return NULL;
+    }
+    if (alignment < sizeof(void*))
+    {
+        // a free object holds the link to the next one
+        alignment = sizeof(void*);
+    }
+    if (object_size > SIZE_MAX / 2 || alignment > SIZE_MAX / 4)
+    {
+        return NULL;
+    }
+
+    pool_t* pool = allocm(sizeof(pool_t));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pool->free = NULL;
+    pool->blocks = NULL;
+    pool->size = align_up(object_size == 0 ? 1 : object_size, alignment);
+    pool->alignment = alignment;
+    pool->first = align_up(sizeof(pool_block_t), alignment);
+    size_t room = POOL_BLOCK - HEADER_SIZE;
+    pool->count = room > pool->first ? (room - pool->first) / pool->size : 0;
+    if (pool->count == 0)
+    {
+        pool->count = 1;
+    }
+    return pool;
+}
+
+/**
+ * @brief Carve a new block into objects for the free list of a pool
+ *
+ * @param pool Pool whose free list is empty
+ * @return void* Object taken off the new list, or NULL if no block could be
+ * obtained
+ */
+__attribute__((noinline)) static void* pool_refill(pool_t* pool)
+{
+    size_t block_size = pool->first + pool->count * pool->size;
+    size_t alignment = pool->alignment < ALIGNMENT ? ALIGNMENT
+                                                   : pool->alignment;
+    pool_block_t* block = allocm_aligned(block_size, alignment);
+    if (block == NULL)
+    {
+        return NULL;
+    }
+    dprintf("Carving %zu objects of %zuB at %p\n", pool->count, pool->size,
+            block);
+    block->next = pool->blocks;
+    pool->blocks = block;
+
+    // the first objects are handed out first
+    uint8_t* obj = (uint8_t*)block + pool->first;
+    for (size_t i = 1; i < pool->count; i++)
+    {
+        *(void**)(obj + (i - 1) * pool->size) = obj + i * pool->size;
+    }
+    *(void**)(obj + (pool->count - 1) * pool->size) = NULL;
+    pool->free = pool->count > 1 ? obj + pool->size : NULL;
+    return obj;
+}
+
+void* pool_alloc(pool_t* pool)
+{
+    void* ptr = pool->free;
+    if (ptr == NULL)
+    {
+        return pool_refill(pool);
+    }
+    pool->free = *(void**)ptr;
+    return ptr;
+}
+
+void pool_free(pool_t* pool, void* ptr)
+{
+    if (ptr != NULL)
+    {
+        *(void**)ptr = pool->free;
+        pool->free = ptr;
+    }
+}
+
+void pool_destroy(pool_t* pool)
+{
+    dprintf("pool = %p\n", pool);
+
+    if (pool == NULL)
+    {
+        return;
+    }
+    pool_block_t* block = pool->blocks;
+    while (block != NULL)
+    {
+        pool_block_t* next = block->next;
+        freem_sized(block, pool->first + pool->count * pool->size);
+        block = next;
+    }
+    freem_sized(pool, sizeof(pool_t));
+}
+
+void allocm_stats(allocm_stats_t* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->heap = __atomic_load_n(&heap_size_g, __ATOMIC_RELAXED);
+    stats->mapped = __atomic_load_n(&mapped_size_g, __ATOMIC_RELAXED);
+
+    size_t arenas = __atomic_load_n(&num_arenas_g, __ATOMIC_ACQUIRE);
+    for (size_t a = 0; a < arenas; a++)
+    {
+        arena_t* arena = &arenas_g[a];
+        for (size_t c = 0; c < ALLOCM_STATS_CLASSES; c++)
+        {
+            size_t bytes =
+                __atomic_load_n(&arena->free_bytes[c], __ATOMIC_RELAXED);
+            stats->free_bytes[c] += bytes;
+            stats->free += bytes;
+        }
+        stats->heap_grows += __atomic_load_n(&arena->grows, __ATOMIC_RELAXED);
+    }
+
+    // the caches of other threads change under us, their sums are a snapshot
+    size_t ops[STAT_OPS];
+    for (size_t op = 0; op < STAT_OPS; op++)
+    {
+        ops[op] = __atomic_load_n(&exited_ops_g[op], __ATOMIC_RELAXED);
+    }
+    pthread_mutex_lock(&threads_lock_g);
+    for (tcache_t* t = threads_g; t != NULL; t = t->next_thread)
+    {
+        for (size_t op = 0; op < STAT_OPS; op++)
+        {
+            ops[op] += __atomic_load_n(&t->ops[op], __ATOMIC_RELAXED);
+        }
+        for (size_t bin = 0; bin < TCACHE_BINS; bin++)
+        {
+            stats->cached += __atomic_load_n(&t->counts[bin],
+                                             __ATOMIC_RELAXED) *
+                             (bin + 1) * ALIGNMENT;
+        }
+    }
+    pthread_mutex_unlock(&threads_lock_g);
+    stats->allocs = ops[STAT_ALLOCS];
+    stats->frees = ops[STAT_FREES];
+    stats->reallocs = ops[STAT_REALLOCS];
+
+    size_t unused = stats->free + stats->cached;
+    stats->in_use = stats->heap > unused ? stats->heap - unused : 0;
+}
+
+/**
+ * @brief Write all of a buffer to a file
+ *
+ * @return 0 on success, -1 if the file cannot be written
+ */
+static int write_all(int fd, const void* buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        buf = (const uint8_t*)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+int allocm_dump_samples(int fd)
+{
+    char line[64 + SAMPLE_DEPTH * 20];
+    int err = 0;
+
+    pthread_mutex_lock(&samples_lock_g);
+    size_t count = 0, bytes = 0;
+    for (sample_t* sample = samples_g; sample != NULL; sample = sample->next)
+    {
+        count++;
+        bytes += sample->size;
+    }
+    int len = snprintf(line, sizeof(line),
+                       "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                       count, bytes, count, bytes,
+                       __atomic_load_n(&sample_rate_g, __ATOMIC_RELAXED));
+    err |= write_all(fd, line, len);
+
+    for (sample_t* sample = samples_g; sample != NULL && !err;
+         sample = sample->next)
+    {
+        len = snprintf(line, sizeof(line), "1: %zu [1: %zu] @", sample->size,
+                       sample->size);
+        for (size_t i = 0; i < sample->depth; i++)
+        {
+            len += snprintf(line + len, sizeof(line) - len, " %p",
+                            sample->stack[i]);
+        }
+        line[len++] = '\n';
+        err |= write_all(fd, line, len);
+    }
+    pthread_mutex_unlock(&samples_lock_g);
+
+    // the address space lets the stacks be symbolized offline
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0)
+    {
+        err |= write_all(fd, "\nMAPPED_LIBRARIES:\n", 19);
+        ssize_t n;
+        while (!err && (n = read(maps, line, sizeof(line))) > 0)
+        {
+            err |= write_all(fd, line, n);
+        }
+        close(maps);
+    }
+
+    return err ? -1 : 0;
+}
+
+/**
+ * @brief Merge a newly freed chunk with its free neighbours, found through the
+ * boundary tags. `start` must not be in a free list; the chunks it absorbs are
+ * removed from theirs.
+ *
+ * @param arena Arena the chunk belongs to
+ * @param start Free chunk to grow
+ * @return void* Start of the merged chunk (`start` or the chunk before it)
+ */
+void* combine_chunks(arena_t* arena, void* start)
+{
+    // cannot combine a chunk that already is allocated
+    if (start == NULL || is_allocated(*get_preamble(arena, start)))
+    {
+        dprintf("Start is allocated!");
+        return start;
+    }
+
+    uint8_t* chunk = start;
+    size_t size = get_chunk_size(arena, chunk);
+    preamble_t prev_free = *get_preamble(arena, chunk) & PREAMB_PREV_FREE;
+
+    // the result is not zero, the size words it absorbs may stay
+    if (prev_free)
+    {
+        size_t prev_size = get_prev_size(arena, chunk);
+        dprintf("Combining %p (%zuB) with previous %p (%zuB)\n", chunk, size,
+                chunk - prev_size, prev_size);
+        chunk -= prev_size;
+        size += prev_size;
+        list_remove(arena, chunk);
+        prev_free = *get_preamble(arena, chunk) & PREAMB_PREV_FREE;
+    }
+
+    // the sentinel after the last chunk is allocated, so this stays in the heap
+    uint8_t* next_chunk = chunk + size;
+    if (!is_allocated(*get_preamble(arena, next_chunk)))
+    {
+        size_t next_size = get_chunk_size(arena, next_chunk);
+        dprintf("Combining %p (%zuB) with next %p (%zuB)\n", chunk, size,
+                next_chunk, next_size);
+        list_remove(arena, next_chunk);
+        size += next_size;
+    }
+
+    set_free(arena, chunk, size, prev_free);
+    return chunk;
+}
+
+void print_heap()
+{
+    dprintf("\n");
+    for (size_t a = 0; a < num_arenas_g; a++)
+    {
+        arena_t* arena = &arenas_g[a];
+        pthread_mutex_lock(&arena->lock);
+        if (arena->start == NULL || arena->end == arena->start)
+        {
+            pthread_mutex_unlock(&arena->lock);
+            continue;
+        }
+
+        int rows = (arena->end - arena->start) / 0x10;
+        int cols = 0x10;
+
+        uint8_t* curr_addr = arena->start;
+
+        printf("\tarena %zu (%zu bytes)\n", a, arena->size);
+        printf("\t  pointer   \t_0____1____2____3____4____5____6____7____8___"
+               "_9___10___11___12___13___14___15\n");
+        // 16 bytes per row
+        for (int i = 0; i < rows; i++)
+        {
+            printf("\t%p:\t", curr_addr);
+            // print each byte
+            for (int j = 0; j < cols; j++)
+            {
+                printf("%02X   ", *curr_addr++);
+            }
+            printf("\n");
+        }
+        printf("\n");
+
+        printf("\t  pointer    size(B)    hex  used \n");
+        // print by chunk
+        curr_addr = arena->start;
+        while (curr_addr < arena->end)
+        {
+            preamble_t preamble = *get_preamble(arena, curr_addr);
+            size_t size = get_chunk_size(arena, curr_addr);
+
+#ifdef SLAB
+            printf("\t%p  %5zu  (%#6zx)   %c\n", curr_addr, size, size,
+                   slab_of(arena, curr_addr + HEADER_SIZE) != NULL ? 'S'
+                   : is_allocated(preamble)                       ? 'X'
+                                                                   : ' ');
+#else
+            printf("\t%p  %5zu  (%#6zx)   %c\n", curr_addr, size, size,
+                   is_allocated(preamble) ? 'X' : ' ');
+#endif
+
+            curr_addr += size;
+        }
+
+        pthread_mutex_unlock(&arena->lock);
     }
-}
\ No newline at end of file
+}
@@ -3,20 +3,155 @@
 
 #include <stdlib.h>
 
+#ifndef _MAX_ALLOC
 #define _MAX_ALLOC  0x20
+#endif
+#ifndef _BLOCK_SIZE
 #define _BLOCK_SIZE 0x40
+#endif
+#ifndef _MMAP_THRESHOLD
+#define _MMAP_THRESHOLD 0x8000
+#endif
+#ifndef _ALIGNMENT
+#define _ALIGNMENT 0x10
+#endif
 
 _Static_assert(_BLOCK_SIZE % _MAX_ALLOC == 0,
                "MAX_ALLOC must be divisible by BLOCK_SIZE");
+_Static_assert(_BLOCK_SIZE % _ALIGNMENT == 0,
+               "BLOCK_SIZE must be a multiple of ALIGNMENT");
 
 /**
- * @brief Allocate block of memory of `size` bytes
+ * Options that can be changed at runtime through `allocm_setopt()`
+ *
+ * ALLOCM_MMAP_THRESHOLD: requests larger than this many bytes get their own
+ *   mmap'd region instead of a heap chunk (default: _MMAP_THRESHOLD)
+ * ALLOCM_ARENAS: number of independent heaps threads are spread over, only
+ *   before the first allocation (default: 0, one per CPU)
+ * ALLOCM_SAMPLE_RATE: mean number of bytes allocated between two allocations
+ *   that are sampled for `allocm_dump_samples()` (default: 0, none)
+ * ALLOCM_DECAY_MS: milliseconds over which freed heap memory is given back
+ *   to the system, gradually so that memory freed and soon needed again
+ *   mostly stays (default: 10000). The clock is looked at every few dozen
+ *   to few thousand calls, so memory only goes back while the program keeps
+ *   calling the allocator. With 0 all of it, however recently freed, goes back
+ *   the next time; blocks held in the threads' caches are not free yet.
+ * ALLOCM_GROW_MIN, ALLOCM_GROW_MAX: bounds of the bytes a heap gets from the
+ *   system at once when it runs out, about as many as it already has
+ *   (default: 0x10000 and 0x4000000)
+ */
+typedef enum
+{
+    ALLOCM_MMAP_THRESHOLD,
+    ALLOCM_ARENAS,
+    ALLOCM_SAMPLE_RATE,
+    ALLOCM_DECAY_MS,
+    ALLOCM_GROW_MIN,
+    ALLOCM_GROW_MAX,
+} allocm_option_t;
+
+// free_bytes[i] of allocm_stats_t covers sizes 2^i to 2^(i+1)-1, the last
+// one all larger sizes too
+#define ALLOCM_STATS_CLASSES 16
+
+/**
+ * Counters returned by `allocm_stats()`. They are kept up to date as memory
+ * changes hands, so reading them costs the same on any heap; with other
+ * threads running they are a snapshot that can be slightly off.
+ *
+ * heap: bytes of the heaps of all arenas, in chunks (not the memory obtained
+ *   from the system ahead of them)
+ * mapped: bytes of the chunks that have their own mmap'd region, and of the
+ *   buddy system when built with it (make buddy)
+ * in_use: bytes of the heaps in use, allocated to the user or holding
+ *   allocator metadata
+ * free: bytes of the heaps in free chunks and slab slots
+ * cached: bytes in free chunks held by the threads' caches
+ * free_bytes[i]: bytes of `free` in chunks and slots of 2^i to 2^(i+1)-1 bytes
+ * allocs: blocks handed out by allocm(), allocm_aligned(), callocm(),
+ *   allocm_batch() and reallocm() when it copies a block
+ * frees: blocks given back through freem(), freem_sized(), freem_batch() and
+ *   reallocm()
+ * reallocs: calls to reallocm()
+ * heap_grows: times a heap got more memory from the system
+ */
+typedef struct
+{
+    size_t heap;
+    size_t mapped;
+    size_t in_use;
+    size_t free;
+    size_t cached;
+    size_t free_bytes[ALLOCM_STATS_CLASSES];
+    size_t allocs;
+    size_t frees;
+    size_t reallocs;
+    size_t heap_grows;
+} allocm_stats_t;
+
+/**
+ * @brief Allocate block of memory of `size` bytes, aligned to `_ALIGNMENT`
  *
  * @param size Number of bytes to allocate
  * @return void* Pointer to start of allocated chunk
  */
 void* allocm(size_t size);
 
+/**
+ * @brief Allocate block of memory of `size` bytes whose address is a multiple
+ * of `alignment` (e.g. a cache line or a page). Free it with `freem()`.
+ *
+ * @param size Number of bytes to allocate
+ * @param alignment Required alignment, must be a power of 2
+ * @return void* Pointer to start of allocated chunk, or NULL if `alignment`
+ * is not a power of 2
+ */
+void* allocm_aligned(size_t size, size_t alignment);
+
+/**
+ * @brief Allocate a zeroed array of `count` elements of `size` bytes, aligned
+ * to `_ALIGNMENT`
+ *
+ * @param count Number of elements
+ * @param size Size of an element
+ * @return void* Pointer to start of allocated chunk, or NULL if `count * size`
+ * overflows
+ */
+void* callocm(size_t count, size_t size);
+
+/**
+ * @brief Allocate `count` blocks of `size` bytes at once, aligned to
+ * `_ALIGNMENT`. Each one is freed with `freem()` or `freem_batch()`.
+ *
+ * @param size Number of bytes per block
+ * @param count Number of blocks to allocate
+ * @param ptrs Array of at least `count` pointers, filled with the blocks
+ * @return number of blocks allocated, less than `count` only if memory ran out
+ */
+size_t allocm_batch(size_t size, size_t count, void** ptrs);
+
+/**
+ * @brief Resize a block of memory previously allocated by `allocm()`, keeping
+ * its contents up to the smaller of the old and new sizes. The block is grown
+ * or shrunk where it is when possible, and large blocks are remapped instead
+ * of copied. Blocks that do move get the alignment of `allocm()`.
+ *
+ * @param ptr Pointer to start of allocated chunk, or NULL to allocate
+ * @param size New number of bytes
+ * @return void* Pointer to start of the resized chunk, or NULL if it could not
+ * be resized (`ptr` is then left untouched)
+ */
+void* reallocm(void* ptr, size_t size);
+
+/**
+ * @brief Get the number of bytes usable in a block of memory, at least the
+ * number requested for it. All of them are kept by `reallocm()`.
+ *
+ * @param ptr Pointer to start of allocated chunk, or NULL
+ * @return size_t Usable bytes, 0 for NULL
+ */
+size_t allocm_usable_size(void* ptr);
+
 /**
  * @brief Deallocate block of memory previously allocated by `allocm()`
  *
@@ -24,4 +159,136 @@ void* allocm(size_t size);
  */
 void freem(void* ptr);
 
+/**
+ * @brief Deallocate block of memory whose size the caller knows, which saves
+ * looking it up. DEBUG builds abort when the size does not fit the block:
+ * larger than `allocm_usable_size(ptr)` or, for a heap chunk, too small for
+ * it.
+ *
+ * @param ptr Pointer to start of allocated chunk to free, or NULL
+ * @param size Number of bytes the block was allocated (or last resized) with,
+ * or any number from that up to `allocm_usable_size(ptr)`
+ */
+void freem_sized(void* ptr, size_t size);
+
+/**
+ * @brief Deallocate `count` blocks of memory at once
+ *
+ * @param ptrs Pointers to start of allocated chunks (NULL entries are skipped)
+ * @param count Number of pointers in `ptrs`
+ */
+void freem_batch(void** ptrs, size_t count);
+
+/**
+ * A region hands out memory that is all freed at once: blocks are bumped
+ * through instead of looked for, and are never freed on their own. A region
+ * must only be used by one thread at a time.
+ */
+typedef struct region region_t;
+
+/**
+ * @brief Create an empty region
+ *
+ * @return region_t* The region, or NULL if memory ran out
+ */
+region_t* region_create(void);
+
+/**
+ * @brief Allocate block of memory of `size` bytes from a region, aligned to
+ * `_ALIGNMENT`. It stays valid until the region is reset or destroyed, and
+ * must not be passed to `freem()` or `reallocm()`.
+ *
+ * @param region Region to allocate from
+ * @param size Number of bytes to allocate
+ * @return void* Pointer to start of the block, or NULL if memory ran out
+ */
+void* region_alloc(region_t* region, size_t size);
+
+/**
+ * @brief Free every block allocated from a region at once. The memory the
+ * region got from the heap is kept for the next allocations (but for that of
+ * large blocks), so this does not depend on how many there were.
+ *
+ * @param region Region to reset
+ */
+void region_reset(region_t* region);
+
+/**
+ * @brief Free every block allocated from a region, and the region itself with
+ * all of its memory
+ *
+ * @param region Region to destroy, or NULL
+ */
+void region_destroy(region_t* region);
+
+/**
+ * A pool hands out objects of a single size, kept on a free list threaded
+ * through the free objects themselves: no header, no search. Objects go back
+ * to the heap only with the whole pool. A pool must only be used by one
+ * thread at a time.
+ */
+typedef struct pool pool_t;
+
+/**
+ * @brief Create a pool of objects of `object_size` bytes
+ *
+ * @param object_size Number of bytes of an object
+ * @param alignment Required alignment of the objects, must be a power of 2
+ * (at least that of a pointer is used)
+ * @return pool_t* The pool, or NULL if `alignment` is not a power of 2 or
+ * memory ran out
+ */
+pool_t* pool_create(size_t object_size, size_t alignment);
+
+/**
+ * @brief Allocate an object from a pool. Free it with `pool_free()` on the
+ * same pool, never with `freem()`.
+ *
+ * @param pool Pool to allocate from
+ * @return void* Pointer to the object, or NULL if memory ran out
+ */
+void* pool_alloc(pool_t* pool);
+
+/**
+ * @brief Give an object back to the pool it was allocated from
+ *
+ * @param pool Pool the object was allocated from
+ * @param ptr Pointer to the object, or NULL
+ */
+void pool_free(pool_t* pool, void* ptr);
+
+/**
+ * @brief Free a pool and all of its objects, including those still allocated
+ *
+ * @param pool Pool to destroy, or NULL
+ */
+void pool_destroy(pool_t* pool);
+
+/**
+ * @brief Change an allocator option
+ *
+ * @param option Option to change
+ * @param value New value of the option
+ * @return 0 on success, -1 if the option or value is invalid
+ */
+int allocm_setopt(allocm_option_t option, size_t value);
+
+/**
+ * @brief Read the allocator's counters. This takes no lock but the one guarding
+ * the list of threads, and does not look at the heap itself.
+ *
+ * @param stats Filled with the counters
+ */
+void allocm_stats(allocm_stats_t* stats);
+
+/**
+ * @brief Write the stacks of the live sampled allocations (see
+ * ALLOCM_SAMPLE_RATE) to a file, in pprof's legacy heap profile format
+ * followed by the process's memory map
+ *
+ * @param fd File descriptor to write to
+ * @return 0 on success, -1 if the file could not be written
+ */
+int allocm_dump_samples(int fd);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,75 @@
+#include "alloc.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/**
+ * Compare the latency of the heap path and the mmap'd large object path.
+ * Every size is timed twice: once with the default threshold and once with a
+ * threshold of 0, which sends every request to its own mapping.
+ */
+
+#define ITERATIONS 20000
+#define LIVE       64
+
+static const size_t sizes[] = {8, 24, 256, 4096, 0x4000, 0x10000, 0x100000};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Time allocm()/freem() of `size` bytes, keeping `LIVE` allocations
+ * alive at once and touching the first byte of each
+ *
+ * @param size Number of bytes per allocation
+ * @return average nanoseconds per allocm()/freem() pair
+ */
+static double bench_size(size_t size)
+{
+    void* ptrs[LIVE];
+    uint64_t start = now_ns();
+
+    for (int i = 0; i < ITERATIONS; i += LIVE)
+    {
+        for (int j = 0; j < LIVE; j++)
+        {
+            ptrs[j] = allocm(size);
+            *(volatile char*)ptrs[j] = 1;
+        }
+        for (int j = 0; j < LIVE; j++)
+        {
+            freem(ptrs[j]);
+        }
+    }
+
+    return (double)(now_ns() - start) / ITERATIONS;
+}
+
+int main(void)
+{
+    printf("%10s  %12s  %12s\n", "size(B)", "heap(ns)", "mmap(ns)");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        printf("%10zu  ", sizes[i]);
+
+        allocm_setopt(ALLOCM_MMAP_THRESHOLD, _MMAP_THRESHOLD);
+        if (sizes[i] <= _MMAP_THRESHOLD)
+        {
+            bench_size(sizes[i]); // warm up the heap
+            printf("%12.1f  ", bench_size(sizes[i]));
+        }
+        else
+        {
+            printf("%12s  ", "-");
+        }
+
+        allocm_setopt(ALLOCM_MMAP_THRESHOLD, 0);
+        printf("%12.1f\n", bench_size(sizes[i]));
+    }
+
+    return 0;
+}
@@ -0,0 +1,328 @@
+#include "alloc.h"
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Time single allocm()/freem() calls under common patterns and report the
+ * mean and percentiles of their latency, with glibc malloc()/free() as a
+ * baseline. glibc runs in a forked child, so that neither allocator's heap
+ * is left in the state the other one's pattern put it in.
+ *
+ * Latencies include the overhead of reading the clock around each call.
+ *
+ * usage: bench/micro [pattern]
+ */
+
+#define OPS       200000
+#define LIVE      1024
+#define SIZE      64
+#define MAX_SWEEP (2 * _MMAP_THRESHOLD)
+#define MAX_GROW  0x1000
+#define POW2_MAX  (_MMAP_THRESHOLD / 2) // all of them stay on the heap
+
+typedef struct
+{
+    const char* name;
+    void* (*alloc)(size_t);
+    void (*free)(void*);
+} allocator_t;
+
+typedef struct
+{
+    double mean;
+    uint64_t p50, p99, p999, max;
+} result_t;
+
+typedef struct
+{
+    const char* name;
+    size_t (*run)(const allocator_t*, uint64_t* lat);
+    int warm_up;
+} pattern_t;
+
+static const allocator_t allocm_g = {"allocm", allocm, freem};
+static const allocator_t glibc_g = {"glibc", malloc, free};
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void* timed_alloc(const allocator_t* a, size_t size, uint64_t* lat)
+{
+    uint64_t start = now_ns();
+    void* ptr = a->alloc(size);
+    *lat = now_ns() - start;
+    *(volatile char*)ptr = 1;
+    return ptr;
+}
+
+static void timed_free(const allocator_t* a, void* ptr, uint64_t* lat)
+{
+    uint64_t start = now_ns();
+    a->free(ptr);
+    *lat = now_ns() - start;
+}
+
+/**
+ * @brief Free every pointer right after allocating it
+ */
+static size_t run_pairs(const allocator_t* a, uint64_t* lat)
+{
+    size_t n = 0;
+    for (int i = 0; i < OPS / 2; i++)
+    {
+        void* ptr = timed_alloc(a, SIZE, &lat[n++]);
+        timed_free(a, ptr, &lat[n++]);
+    }
+    return n;
+}
+
+/**
+ * @brief Allocate LIVE pointers, then free them in the order given by `order`
+ */
+static size_t run_order(const allocator_t* a, uint64_t* lat, const int* order)
+{
+    void* ptrs[LIVE];
+    size_t n = 0;
+    for (int i = 0; i < OPS / (2 * LIVE); i++)
+    {
+        for (int j = 0; j < LIVE; j++)
+        {
+            ptrs[j] = timed_alloc(a, SIZE, &lat[n++]);
+        }
+        for (int j = 0; j < LIVE; j++)
+        {
+            timed_free(a, ptrs[order[j]], &lat[n++]);
+        }
+    }
+    return n;
+}
+
+static size_t run_lifo(const allocator_t* a, uint64_t* lat)
+{
+    int order[LIVE];
+    for (int i = 0; i < LIVE; i++)
+    {
+        order[i] = LIVE - 1 - i;
+    }
+    return run_order(a, lat, order);
+}
+
+static size_t run_fifo(const allocator_t* a, uint64_t* lat)
+{
+    int order[LIVE];
+    for (int i = 0; i < LIVE; i++)
+    {
+        order[i] = i;
+    }
+    return run_order(a, lat, order);
+}
+
+static size_t run_random(const allocator_t* a, uint64_t* lat)
+{
+    int order[LIVE];
+    unsigned seed = 1;
+    for (int i = 0; i < LIVE; i++)
+    {
+        order[i] = i;
+    }
+    for (int i = LIVE - 1; i > 0; i--)
+    {
+        int j = rand_r(&seed) % (i + 1);
+        int tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    return run_order(a, lat, order);
+}
+
+/**
+ * @brief Allocate and free every size from 0 to MAX_SWEEP in turn, stepping
+ * by an eighth of the size so small sizes are all covered
+ */
+static size_t run_sweep(const allocator_t* a, uint64_t* lat)
+{
+    size_t n = 0;
+    size_t size = 0;
+    while (n < OPS)
+    {
+        void* ptr = timed_alloc(a, size, &lat[n++]);
+        timed_free(a, ptr, &lat[n++]);
+        size = size >= MAX_SWEEP ? 0 : size + size / 8 + 1;
+    }
+    return n;
+}
+
+/**
+ * @brief Keep every allocation alive until the end so the heap has to grow,
+ * then free them all
+ */
+static size_t run_grow(const allocator_t* a, uint64_t* lat)
+{
+    void** ptrs = malloc(OPS / 2 * sizeof(void*));
+    unsigned seed = 1;
+    size_t n = 0;
+    for (int i = 0; i < OPS / 2; i++)
+    {
+        ptrs[i] = timed_alloc(a, rand_r(&seed) % MAX_GROW, &lat[n++]);
+    }
+    for (int i = 0; i < OPS / 2; i++)
+    {
+        timed_free(a, ptrs[i], &lat[n++]);
+    }
+    free(ptrs);
+    return n;
+}
+
+/**
+ * @brief Keep LIVE buffers of random powers of two from SIZE to POW2_MAX
+ * bytes, replacing a random one at every step
+ */
+static size_t run_pow2(const allocator_t* a, uint64_t* lat)
+{
+    void* ptrs[LIVE];
+    unsigned seed = 1;
+    int shifts = __builtin_ctz(POW2_MAX / SIZE) + 1;
+    for (int i = 0; i < LIVE; i++)
+    {
+        ptrs[i] = a->alloc(SIZE << rand_r(&seed) % shifts);
+    }
+    size_t n = 0;
+    while (n < OPS)
+    {
+        int j = rand_r(&seed) % LIVE;
+        timed_free(a, ptrs[j], &lat[n++]);
+        ptrs[j] = timed_alloc(a, SIZE << rand_r(&seed) % shifts, &lat[n++]);
+    }
+    for (int i = 0; i < LIVE; i++)
+    {
+        a->free(ptrs[i]);
+    }
+    return n;
+}
+
+static const pattern_t patterns[] = {
+    {"pairs", run_pairs, 1}, {"lifo", run_lifo, 1},   {"fifo", run_fifo, 1},
+    {"random", run_random, 1}, {"sweep", run_sweep, 1}, {"grow", run_grow, 0},
+    {"pow2", run_pow2, 1},
+};
+
+static int cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Run a pattern with an allocator and summarise the latencies of its
+ * calls
+ */
+static result_t measure(const pattern_t* p, const allocator_t* a)
+{
+    uint64_t* lat = malloc(OPS * sizeof(uint64_t));
+    if (p->warm_up)
+    {
+        p->run(a, lat);
+    }
+    size_t n = p->run(a, lat);
+
+    result_t r = {0};
+    for (size_t i = 0; i < n; i++)
+    {
+        r.mean += lat[i];
+    }
+    r.mean /= n;
+    qsort(lat, n, sizeof(uint64_t), cmp_u64);
+    r.p50 = lat[n / 2];
+    r.p99 = lat[n * 99 / 100];
+    r.p999 = lat[n * 999 / 1000];
+    r.max = lat[n - 1];
+    free(lat);
+
+    return r;
+}
+
+/**
+ * @brief Measure a pattern with glibc in a forked child, which reports back
+ * through a pipe
+ */
+static int measure_glibc(const pattern_t* p, result_t* r)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        close(fds[0]);
+        result_t child = measure(p, &glibc_g);
+        _exit(write(fds[1], &child, sizeof(child)) != sizeof(child));
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], r, sizeof(*r));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+
+    return got == sizeof(*r) && WIFEXITED(status) && WEXITSTATUS(status) == 0
+               ? 0
+               : -1;
+}
+
+static void print_result(const char* pattern, const char* allocator,
+                         const result_t* r)
+{
+    printf("%8s  %8s  %10.1f  %8" PRIu64 "  %8" PRIu64 "  %8" PRIu64
+           "  %10" PRIu64 "\n",
+           pattern, allocator, r->mean, r->p50, r->p99, r->p999, r->max);
+}
+
+int main(int argc, char** argv)
+{
+    printf("%8s  %8s  %10s  %8s  %8s  %8s  %10s\n", "pattern", "alloc",
+           "ns/op", "p50", "p99", "p99.9", "max");
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++)
+    {
+        const pattern_t* p = &patterns[i];
+        if (argc > 1 && strcmp(argv[1], p->name) != 0)
+        {
+            continue;
+        }
+
+        // glibc first, so the child does not inherit a grown allocm heap
+        fflush(stdout);
+        result_t r;
+        if (measure_glibc(p, &r) == 0)
+        {
+            print_result(p->name, glibc_g.name, &r);
+        }
+        else
+        {
+            printf("%8s  %8s  failed\n", p->name, glibc_g.name);
+        }
+
+        r = measure(p, &allocm_g);
+        print_result(p->name, allocm_g.name, &r);
+    }
+
+    return 0;
+}
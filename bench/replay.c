@@ -0,0 +1,328 @@
+#include "alloc.h"
+#include "trace.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Replay an allocation trace recorded with ALLOCM_TRACE (see trace.h) and
+ * report how long it took, the peak heap size and the fragmentation: the
+ * share of the peak footprint (the heaps and the mapped chunks, which include
+ * the buddy system and sampled blocks) beyond the most bytes the requests had
+ * live at once.
+ *
+ * The trace is decoded up front, turning recorded addresses into object
+ * numbers, so only the allocator calls are timed. The records of all threads
+ * are replayed by one thread, in the order they were written. Everything here
+ * is mmap'd, so the replayed heap only holds the trace's blocks.
+ *
+ * usage: bench/replay <trace>
+ */
+
+#define NO_OBJECT UINT32_MAX
+
+extern size_t heap_size_g;
+extern size_t mapped_size_g;
+
+typedef struct
+{
+    uint8_t op;
+    uint32_t obj;     // object freed or resized
+    uint32_t new_obj; // object allocated
+    size_t size;
+    size_t alignment;
+} op_t;
+
+typedef struct
+{
+    uintptr_t addr; // 0 for an empty entry
+    uint32_t obj;
+} entry_t;
+
+static entry_t* table_g;
+static size_t table_mask_g;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void* map(size_t size)
+{
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static inline size_t slot_of(uintptr_t addr)
+{
+    return (addr >> 4) * 0x9e3779b97f4a7c15ULL >> 20 & table_mask_g;
+}
+
+/**
+ * @brief Find the entry of a live address, or the empty one it would go in
+ */
+static entry_t* lookup(uintptr_t addr)
+{
+    size_t i = slot_of(addr);
+    while (table_g[i].addr != 0 && table_g[i].addr != addr)
+    {
+        i = (i + 1) & table_mask_g;
+    }
+    return &table_g[i];
+}
+
+/**
+ * @brief Remove an entry, moving the ones probed past it back
+ */
+static void erase(entry_t* entry)
+{
+    size_t hole = entry - table_g;
+    size_t i = hole;
+    for (;;)
+    {
+        i = (i + 1) & table_mask_g;
+        if (table_g[i].addr == 0)
+        {
+            break;
+        }
+        // an entry can fill the hole if the hole is between its slot and it
+        size_t home = slot_of(table_g[i].addr);
+        if (((i - home) & table_mask_g) >= ((i - hole) & table_mask_g))
+        {
+            table_g[hole] = table_g[i];
+            hole = i;
+        }
+    }
+    table_g[hole].addr = 0;
+}
+
+/**
+ * @brief Number the object at a live address, removing it from the table
+ *
+ * @return its number, or NO_OBJECT if the address is not live (it was
+ * allocated before the trace started, or is freed twice)
+ */
+static uint32_t take(uintptr_t addr)
+{
+    if (addr == 0)
+    {
+        return NO_OBJECT;
+    }
+    entry_t* entry = lookup(addr);
+    if (entry->addr == 0)
+    {
+        return NO_OBJECT;
+    }
+    uint32_t obj = entry->obj;
+    erase(entry);
+    return obj;
+}
+
+/**
+ * @brief Decode a trace into operations on numbered objects
+ *
+ * @param pos Start of the records
+ * @param end End of the trace
+ * @param ops Filled with the operations
+ * @param objects Set to the number of objects allocated
+ * @return number of operations, or -1 if the trace is cut short or corrupt
+ */
+static long decode(const uint8_t* pos, const uint8_t* end, op_t* ops,
+                   uint32_t* objects)
+{
+    uintptr_t last = 0;
+    long n = 0;
+    *objects = 0;
+
+    while (pos < end)
+    {
+        op_t* op = &ops[n];
+        op->op = *pos++;
+        op->obj = op->new_obj = NO_OBJECT;
+        op->alignment = 0;
+
+        uintptr_t ptr = 0, result = 0;
+        uint64_t size = 0, alignment = 0;
+        int err = 0;
+        switch (op->op)
+        {
+        case TRACE_ALLOC:
+        case TRACE_CALLOC:
+            err |= trace_get(&pos, end, &size);
+            err |= trace_get_ptr(&pos, end, &result, &last);
+            break;
+        case TRACE_ALIGNED:
+            err |= trace_get(&pos, end, &size);
+            err |= trace_get(&pos, end, &alignment);
+            err |= trace_get_ptr(&pos, end, &result, &last);
+            break;
+        case TRACE_REALLOC:
+            err |= trace_get_ptr(&pos, end, &ptr, &last);
+            err |= trace_get(&pos, end, &size);
+            err |= trace_get_ptr(&pos, end, &result, &last);
+            break;
+        case TRACE_FREE:
+            err |= trace_get_ptr(&pos, end, &ptr, &last);
+            break;
+        default:
+            fprintf(stderr, "Unknown record %d\n", op->op);
+            return -1;
+        }
+        if (err)
+        {
+            fprintf(stderr, "Trace is cut short\n");
+            return -1;
+        }
+        op->size = size;
+        op->alignment = alignment;
+
+        // a failed reallocm() leaves the object where it was
+        if (op->op == TRACE_REALLOC && result == 0 && ptr != 0)
+        {
+            continue;
+        }
+        op->obj = take(ptr);
+        if (op->op == TRACE_FREE && op->obj == NO_OBJECT)
+        {
+            continue;
+        }
+        if (result != 0)
+        {
+            entry_t* entry = lookup(result);
+            entry->addr = result;
+            entry->obj = op->new_obj = (*objects)++;
+        }
+        n++;
+    }
+
+    return n;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s <trace>\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < TRACE_MAGIC_LEN)
+    {
+        fprintf(stderr, "Could not read %s\n", argv[1]);
+        return 1;
+    }
+    const uint8_t* trace =
+        mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (trace == MAP_FAILED || memcmp(trace, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0)
+    {
+        fprintf(stderr, "%s is not an allocation trace\n", argv[1]);
+        return 1;
+    }
+
+    // every record takes at least 2 bytes, and allocates at most one object
+    size_t max_ops = st.st_size / 2;
+    size_t entries = 16;
+    while (entries < 2 * max_ops)
+    {
+        entries *= 2;
+    }
+    table_mask_g = entries - 1;
+    table_g = map(entries * sizeof(entry_t));
+    op_t* ops = map(max_ops * sizeof(op_t));
+    if (table_g == NULL || ops == NULL)
+    {
+        fprintf(stderr, "Trace is too large\n");
+        return 1;
+    }
+
+    uint32_t objects;
+    long n = decode(trace + TRACE_MAGIC_LEN, trace + st.st_size, ops, &objects);
+    if (n < 0)
+    {
+        return 1;
+    }
+    munmap(table_g, entries * sizeof(entry_t));
+    void** ptrs = map((objects + 1) * sizeof(void*));
+    size_t* sizes = map((objects + 1) * sizeof(size_t));
+    if (ptrs == NULL || sizes == NULL)
+    {
+        fprintf(stderr, "Trace is too large\n");
+        return 1;
+    }
+    printf("Replaying %ld operations on %u objects\n", n, objects);
+
+    size_t live = 0, peak_live = 0, peak_heap = 0, peak_total = 0;
+    uint64_t start = now_ns();
+    for (long i = 0; i < n; i++)
+    {
+        const op_t* op = &ops[i];
+        void* old = op->obj == NO_OBJECT ? NULL : ptrs[op->obj];
+        void* ptr = NULL;
+        if (op->obj != NO_OBJECT)
+        {
+            live -= sizes[op->obj];
+        }
+
+        switch (op->op)
+        {
+        case TRACE_ALLOC:
+            ptr = allocm(op->size);
+            break;
+        case TRACE_ALIGNED:
+            ptr = allocm_aligned(op->size, op->alignment);
+            break;
+        case TRACE_CALLOC:
+            ptr = callocm(1, op->size);
+            break;
+        case TRACE_REALLOC:
+            ptr = reallocm(old, op->size);
+            break;
+        case TRACE_FREE:
+            freem(old);
+            break;
+        }
+
+        if (op->new_obj != NO_OBJECT)
+        {
+            ptrs[op->new_obj] = ptr;
+            sizes[op->new_obj] = ptr != NULL ? op->size : 0;
+            live += sizes[op->new_obj];
+        }
+        if (live > peak_live)
+        {
+            peak_live = live;
+        }
+        if (heap_size_g > peak_heap)
+        {
+            peak_heap = heap_size_g;
+        }
+        if (heap_size_g + mapped_size_g > peak_total)
+        {
+            peak_total = heap_size_g + mapped_size_g;
+        }
+    }
+    double elapsed = now_ns() - start;
+
+    printf("%-16s %12.2f ms (%.1f ns/op)\n", "time", elapsed / 1e6,
+           elapsed / n);
+    printf("%-16s %12zu B\n", "peak heap", peak_heap);
+    printf("%-16s %12zu B\n", "peak footprint", peak_total);
+    printf("%-16s %12zu B\n", "peak live", peak_live);
+    printf("%-16s %12.1f %%\n", "fragmentation",
+           peak_total > peak_live
+               ? 100.0 * (peak_total - peak_live) / peak_total
+               : 0.0);
+
+    return 0;
+}
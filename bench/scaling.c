@@ -0,0 +1,74 @@
+#include "alloc.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Measure allocm()/freem() throughput with 1 to N threads. Every thread keeps
+ * LIVE allocations of random sizes alive and replaces one at a time.
+ *
+ * usage: bench/scaling [max threads] [arenas]
+ */
+
+#define OPS      1000000
+#define LIVE     256
+#define MAX_SIZE 512
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void* worker(void* arg)
+{
+    unsigned seed = (uintptr_t)arg;
+    void* ptrs[LIVE] = {0};
+
+    for (int i = 0; i < OPS; i++)
+    {
+        int slot = rand_r(&seed) % LIVE;
+        freem(ptrs[slot]);
+        ptrs[slot] = allocm(rand_r(&seed) % MAX_SIZE);
+        *(volatile char*)ptrs[slot] = 1;
+    }
+    for (int i = 0; i < LIVE; i++)
+    {
+        freem(ptrs[i]);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    if (argc > 2)
+    {
+        allocm_setopt(ALLOCM_ARENAS, atoi(argv[2]));
+    }
+    pthread_t threads[max_threads];
+
+    printf("%8s  %14s  %14s\n", "threads", "Mops/s", "ns/op/thread");
+    for (int n = 1; n <= max_threads; n *= 2)
+    {
+        uint64_t start = now_ns();
+        for (int i = 0; i < n; i++)
+        {
+            pthread_create(&threads[i], NULL, worker, (void*)(uintptr_t)i);
+        }
+        for (int i = 0; i < n; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+        double elapsed = now_ns() - start;
+
+        printf("%8d  %14.2f  %14.1f\n", n, n * (double)OPS / elapsed * 1e3,
+               elapsed / OPS);
+    }
+
+    return 0;
+}
@@ -11,9 +11,7 @@ extern void print_heap();
 int main(void)
 {
     printf("Hello, World!\n");
-    printf("Max bytes you can allocate: %d\n"
-           "Num bytes added per heap resize: %d\n",
-           _MAX_ALLOC, _BLOCK_SIZE);
+    printf("Max bytes allocated from the heap: %d\n", _MMAP_THRESHOLD);
 
 #define NUM_PTRS 8
     void* ptrs[NUM_PTRS];
@@ -0,0 +1,134 @@
+#include "alloc.h"
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/**
+ * malloc() and friends on top of allocm, built into libealloc.so (make lib)
+ * to replace the allocator of a program without relinking it:
+ *
+ *   LD_PRELOAD=./libealloc.so program
+ *
+ * Every glibc call that hands out memory for free() is replaced, so no block
+ * of glibc's heap ever reaches freem(). Only these functions are exported
+ * from the library, the allocator itself is hidden so it cannot be interposed.
+ *
+ * ALLOCM_TRACE works as usual, recording the program's allocations for
+ * bench/replay.
+ */
+
+#define EXPORT __attribute__((visibility("default")))
+
+static inline void* check(void* ptr)
+{
+    if (ptr == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+/**
+ * @brief Allocate with an alignment given by the caller, as aligned_alloc()
+ * and memalign() do: any power of 2 is accepted
+ */
+static void* aligned(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    return check(allocm_aligned(size, alignment));
+}
+
+EXPORT void* malloc(size_t size)
+{
+    return check(allocm(size));
+}
+
+EXPORT void free(void* ptr)
+{
+    freem(ptr);
+}
+
+// C23's, for callers that know the size of what they free
+EXPORT void free_sized(void* ptr, size_t size)
+{
+    freem_sized(ptr, size);
+}
+
+EXPORT void free_aligned_sized(void* ptr, size_t alignment, size_t size)
+{
+    (void)alignment;
+    freem_sized(ptr, size);
+}
+
+EXPORT void* calloc(size_t count, size_t size)
+{
+    return check(callocm(count, size));
+}
+
+EXPORT void* realloc(void* ptr, size_t size)
+{
+    return check(reallocm(ptr, size));
+}
+
+EXPORT void* reallocarray(void* ptr, size_t count, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return check(reallocm(ptr, total));
+}
+
+EXPORT int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+    if (alignment == 0 || alignment % sizeof(void*) != 0 ||
+        (alignment & (alignment - 1)) != 0)
+    {
+        return EINVAL;
+    }
+    void* result = allocm_aligned(size, alignment);
+    if (result == NULL)
+    {
+        return ENOMEM;
+    }
+    *ptr = result;
+    return 0;
+}
+
+EXPORT void* aligned_alloc(size_t alignment, size_t size)
+{
+    return aligned(alignment, size);
+}
+
+EXPORT void* memalign(size_t alignment, size_t size)
+{
+    return aligned(alignment, size);
+}
+
+EXPORT void* valloc(size_t size)
+{
+    return aligned(sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void* pvalloc(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    // whole pages, at least one
+    return aligned(page, size == 0 ? page : (size + page - 1) & ~(page - 1));
+}
+
+EXPORT size_t malloc_usable_size(void* ptr)
+{
+    return allocm_usable_size(ptr);
+}
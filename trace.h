@@ -0,0 +1,135 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Allocation traces, written when the ALLOCM_TRACE environment variable names
+ * a file and read back by bench/replay.
+ *
+ * A trace starts with TRACE_MAGIC, followed by records of one opcode byte and
+ * its fields, each an unsigned LEB128 varint:
+ *
+ * TRACE_ALLOC:   size, ptr
+ * TRACE_ALIGNED: size, alignment, ptr
+ * TRACE_CALLOC:  size (count * size), ptr
+ * TRACE_REALLOC: old ptr, size, new ptr
+ * TRACE_FREE:    ptr
+ *
+ * A pointer is stored as its zigzag encoded distance to the previous pointer
+ * of the trace plus 1, 0 being NULL, so that the addresses of a heap take a
+ * few bytes each. Records of all threads go to one trace in the order the
+ * memory changed hands: frees are written before the memory is released and
+ * allocations after they succeeded.
+ *
+ * A trace covers the process that opened it, and is started over by a
+ * program that process execs (a wrapper script's, for one). The processes it
+ * forks do not write to it. Records are buffered and written out when the
+ * buffer is full, before fork() and at exit(), so a process that ends with
+ * _exit() or a signal loses the last ones.
+ */
+#define TRACE_MAGIC     "ALLOCMT1"
+#define TRACE_MAGIC_LEN 8
+
+#define TRACE_ALLOC   1
+#define TRACE_ALIGNED 2
+#define TRACE_CALLOC  3
+#define TRACE_REALLOC 4
+#define TRACE_FREE    5
+
+// longest record: opcode and three fields of up to 10 bytes
+#define TRACE_MAX_RECORD 31
+
+/**
+ * @brief Append a varint to a record
+ *
+ * @param buf Where to write (room for 10 bytes)
+ * @param value Value to write
+ * @return number of bytes written
+ */
+static inline size_t trace_put(uint8_t* buf, uint64_t value)
+{
+    size_t n = 0;
+    while (value >= 0x80)
+    {
+        buf[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    buf[n++] = value;
+    return n;
+}
+
+/**
+ * @brief Append a pointer to a record
+ *
+ * @param buf Where to write (room for 10 bytes)
+ * @param ptr Pointer to write
+ * @param last Previous pointer of the trace, updated unless `ptr` is NULL
+ * @return number of bytes written
+ */
+static inline size_t trace_put_ptr(uint8_t* buf, const void* ptr,
+                                   uintptr_t* last)
+{
+    if (ptr == NULL)
+    {
+        return trace_put(buf, 0);
+    }
+    int64_t delta = (int64_t)((uintptr_t)ptr - *last);
+    *last = (uintptr_t)ptr;
+    return trace_put(buf, (((uint64_t)delta << 1) ^ (delta >> 63)) + 1);
+}
+
+/**
+ * @brief Read a varint of a record
+ *
+ * @param pos Position in the trace, moved past the varint
+ * @param end End of the trace
+ * @param value Set to the value read
+ * @return 0 on success, -1 if the trace ends within the varint
+ */
+static inline int trace_get(const uint8_t** pos, const uint8_t* end,
+                            uint64_t* value)
+{
+    *value = 0;
+    for (int shift = 0; *pos < end && shift < 64; shift += 7)
+    {
+        uint8_t byte = *(*pos)++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (byte < 0x80)
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Read a pointer of a record
+ *
+ * @param pos Position in the trace, moved past the pointer
+ * @param end End of the trace
+ * @param ptr Set to the pointer read (0 for NULL)
+ * @param last Previous pointer of the trace, updated unless it is NULL
+ * @return 0 on success, -1 if the trace ends within the pointer
+ */
+static inline int trace_get_ptr(const uint8_t** pos, const uint8_t* end,
+                                uintptr_t* ptr, uintptr_t* last)
+{
+    uint64_t value;
+    if (trace_get(pos, end, &value) != 0)
+    {
+        return -1;
+    }
+    if (value == 0)
+    {
+        *ptr = 0;
+        return 0;
+    }
+    value--;
+    *last += (uintptr_t)((value >> 1) ^ -(value & 1));
+    *ptr = *last;
+    return 0;
+}
+
+#endif